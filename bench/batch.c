@@ -0,0 +1,221 @@
+/*
+ * Lua TZ
+ *
+ * Copyright (C) 2014-2023 Andre Naef
+ */
+
+
+#include "../src/tz.c"  /* internal lookups, measured outside the Lua API */
+#include <lauxlib.h>
+#include <lualib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+
+#define BATCH_COUNT  1000000     /* default number of times */
+#define BATCH_FROM   -2208988800 /* start of random times (1900-01-01) */
+#define BATCH_SPAN   4354819200  /* span of random times (to 2038-01-01) */
+#define BATCH_INFO   2           /* stack index of tz.info */
+
+
+static const char *batch_zones[] = { "UTC", "Asia/Kolkata", "Europe/Zurich", "America/New_York",
+		"Asia/Jerusalem", NULL };
+
+
+static uint64_t batch_now(void);
+static uint64_t batch_single(lua_State *L, const char *format, int64_t *t, int n, const char *zone);
+static uint64_t batch_packed(lua_State *L, const char *function, const char *zone);
+static uint64_t batch_find(struct tz_data *data, int64_t *t, int n);
+static uint64_t batch_indexbatch(struct tz_data *data, int64_t *t, int32_t *index, int n);
+
+
+static volatile int32_t  batch_sink;  /* keeps lookup results alive */
+
+
+static uint64_t batch_now (void) {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t batch_single (lua_State *L, const char *format, int64_t *t, int n,
+		const char *zone) {
+	int       i;
+	uint64_t  start;
+
+	start = batch_now();
+	for (i = 0; i < n; i++) {
+		lua_getfield(L, 1, "date");
+		lua_pushstring(L, format);
+		lua_pushinteger(L, t[i]);
+		lua_pushstring(L, zone);
+		lua_call(L, 3, 1);
+		lua_pop(L, 1);
+	}
+	return batch_now() - start;
+}
+
+static uint64_t batch_packed (lua_State *L, const char *function, const char *zone) {
+	uint64_t  start;
+
+	start = batch_now();
+	lua_getfield(L, 1, function);
+	lua_pushvalue(L, 4);
+	lua_pushstring(L, zone);
+	lua_call(L, 2, 1);
+	lua_pop(L, 1);
+	return batch_now() - start;
+}
+
+static uint64_t batch_find (struct tz_data *data, int64_t *t, int n) {
+	int       i;
+	int32_t   sum;
+	uint64_t  start;
+
+	start = batch_now();
+	sum = 0;
+	for (i = 0; i < n; i++) {
+		sum += tz_find(data, t[i], -1, 0)->gmtoff;
+	}
+	batch_sink = sum;
+	return batch_now() - start;
+}
+
+static uint64_t batch_indexbatch (struct tz_data *data, int64_t *t, int32_t *index, int n) {
+	uint64_t  start;
+
+	start = batch_now();
+	tz_indexbatch(data, t, index, n);
+	batch_sink = index[n - 1];
+	return batch_now() - start;
+}
+
+int main (int argc, char *argv[]) {
+	int               n, i;
+	int32_t          *index;
+	int64_t          *t;
+	uint64_t          seed, start, single, list, packed;
+	lua_State        *L;
+	const char      **zones, **zone;
+	struct tz_data   *data;
+
+	/* arguments */
+	n = argc > 1 ? atoi(argv[1]) : BATCH_COUNT;
+	if (n < 1) {
+		fprintf(stderr, "usage: %s [count [timezone ...]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	zones = argc > 2 ? (const char **)&argv[2] : batch_zones;
+
+	/* random, unsorted times */
+	t = malloc(n * sizeof(int64_t));
+	index = malloc(n * sizeof(int32_t));
+	if (!t || !index) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	seed = 88172645463325252ULL;
+	for (i = 0; i < n; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		t[i] = BATCH_FROM + (int64_t)(seed % BATCH_SPAN);
+	}
+
+	/* set up Lua state */
+	L = luaL_newstate();
+	luaL_openlibs(L);
+#if LUA_VERSION_NUM >= 502
+	luaL_requiref(L, "tz", luaopen_tz, 1);
+#else
+	lua_pushcfunction(L, luaopen_tz);
+	lua_pushstring(L, "tz");
+	lua_call(L, 1, 1);
+#endif
+	lua_getfield(L, 1, "info");
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_pushinteger(L, t[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushlstring(L, (const char *)t, n * sizeof(int64_t));
+
+	/* measure lookups */
+	printf("%-20s %12s %12s %12s %12s %8s\n", "timezone", "strategy", "single ns", "list ns",
+			"packed ns", "speedup");
+	for (zone = zones; *zone; zone++) {
+		lua_getfield(L, 1, "strategy");
+		lua_pushstring(L, *zone);
+		if (lua_pcall(L, 1, 1, 0) != 0) {
+			fprintf(stderr, "%s\n", lua_tostring(L, -1));
+			return EXIT_FAILURE;
+		}
+
+		/* one call per time */
+		start = batch_now();
+		for (i = 0; i < n; i++) {
+			lua_pushvalue(L, BATCH_INFO);
+			lua_pushinteger(L, t[i]);
+			lua_pushstring(L, *zone);
+			lua_call(L, 2, 1);
+			lua_pop(L, 1);
+		}
+		single = batch_now() - start;
+
+		/* list of times */
+		start = batch_now();
+		lua_pushvalue(L, BATCH_INFO);
+		lua_pushvalue(L, 3);
+		lua_pushstring(L, *zone);
+		lua_call(L, 2, 1);
+		lua_pop(L, 1);
+		list = batch_now() - start;
+
+		/* packed times */
+		start = batch_now();
+		lua_pushvalue(L, BATCH_INFO);
+		lua_pushvalue(L, 4);
+		lua_pushstring(L, *zone);
+		lua_call(L, 2, 1);
+		lua_pop(L, 1);
+		packed = batch_now() - start;
+
+		printf("%-20s %12s %12.1f %12.1f %12.1f %7.1fx\n", *zone, lua_tostring(L, -1),
+				(double)single / n, (double)list / n, (double)packed / n,
+				(double)single / packed);
+		lua_pop(L, 1);
+		lua_gc(L, LUA_GCCOLLECT, 0);
+	}
+
+	/* measure breakdowns and formatting */
+	lua_getfield(L, 1, "simd");
+	printf("\n%-20s %12s %12s %12s %12s %12s\n", "timezone", "simd", "*t ns", "breakdown ns",
+			"ISO date ns", "isoformat ns");
+	for (zone = zones; *zone; zone++) {
+		printf("%-20s %12s", *zone, lua_tostring(L, 5));
+		printf(" %12.1f", (double)batch_single(L, "*t", t, n, *zone) / n);
+		printf(" %12.1f", (double)batch_packed(L, "breakdown", *zone) / n);
+		printf(" %12.1f", (double)batch_single(L, "%Y-%m-%dT%H:%M:%S%z", t, n, *zone) / n);
+		printf(" %12.1f\n", (double)batch_packed(L, "isoformat", *zone) / n);
+		lua_gc(L, LUA_GCCOLLECT, 0);
+	}
+
+	/* measure internal lookups, without the Lua API */
+	printf("\n%-20s %12s %13s %8s\n", "timezone", "find ns", "indexbatch ns", "speedup");
+	for (zone = zones; *zone; zone++) {
+		data = tz_data(L, *zone, strlen(*zone));
+		lua_pop(L, 1);
+		single = batch_find(data, t, n);
+		packed = batch_indexbatch(data, t, index, n);
+		printf("%-20s %12.1f %13.1f %7.1fx\n", *zone, (double)single / n, (double)packed / n,
+				(double)single / packed);
+	}
+	lua_close(L);
+	free(index);
+	free(t);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,362 @@
+/*
+ * Lua TZ
+ *
+ * Copyright (C) 2014-2023 Andre Naef
+ */
+
+
+#include "../src/tz.h"
+#include <lauxlib.h>
+#include <lualib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+
+
+#define GLIBC_FROM     0           /* default sweep start (1970-01-01) */
+#define GLIBC_TO       2145916800  /* default sweep end (2038-01-01) */
+#define GLIBC_STEP     86399       /* default sweep step; odd to vary the time of day */
+#define GLIBC_DETAILS  3           /* mismatches reported in detail per zone and function */
+#define GLIBC_FORMAT   "%Y-%m-%d %H:%M:%S %z %Z"
+#define GLIBC_INFO     2           /* stack index of tz.info */
+#define GLIBC_DATE     3           /* stack index of tz.date */
+#define GLIBC_TIME     4           /* stack index of tz.time */
+
+
+struct glibc_zones {
+	char    **names;
+	size_t    cnt, alloc;
+};
+
+struct glibc_totals {
+	size_t    zones, samples, mismatches[3];
+	uint64_t  tz[3], libc[3];
+};
+
+
+static struct glibc_zones glibc_list;
+static const char *glibc_functions[3] = { "info", "date", "time" };
+
+
+static int glibc_collect(const char *path, const struct stat *sb, int flag, struct FTW *ftw);
+static int glibc_namecompare(const void *a, const void *b);
+static uint64_t glibc_now(void);
+static void glibc_pushtm(lua_State *L, struct tm *tm);
+static void glibc_mismatch(const char *zone, int function, int64_t t, size_t *count,
+		const char *expected, const char *actual);
+static void glibc_compare(lua_State *L, const char *zone, int64_t from, int64_t to, int64_t step,
+		struct glibc_totals *totals);
+static void glibc_measure(lua_State *L, const char *zone, int64_t from, int64_t to, int64_t step,
+		struct glibc_totals *totals);
+
+
+static int glibc_collect (const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+	FILE        *f;
+	char         magic[4], **names;
+	const char  *name;
+
+	(void)sb;
+	name = path + sizeof(TZ_ZONEINFO) - 1;
+	if (flag == FTW_D && (strcmp(name, "posix") == 0 || strcmp(name, "right") == 0)) {
+		return FTW_SKIP_SUBTREE;
+	}
+	if (flag != FTW_F || ftw->level == 0 || strcmp(name, "localtime") == 0) {
+		return FTW_CONTINUE;
+	}
+	f = fopen(path, "rb");
+	if (!f) {
+		return FTW_CONTINUE;
+	}
+	if (fread(magic, 4, 1, f) != 1 || memcmp(magic, "TZif", 4) != 0) {
+		fclose(f);
+		return FTW_CONTINUE;
+	}
+	fclose(f);
+	if (glibc_list.cnt == glibc_list.alloc) {
+		glibc_list.alloc = glibc_list.alloc ? glibc_list.alloc * 2 : 512;
+		names = realloc(glibc_list.names, glibc_list.alloc * sizeof(char *));
+		if (!names) {
+			return FTW_STOP;
+		}
+		glibc_list.names = names;
+	}
+	glibc_list.names[glibc_list.cnt] = strdup(name);
+	if (!glibc_list.names[glibc_list.cnt]) {
+		return FTW_STOP;
+	}
+	glibc_list.cnt++;
+	return FTW_CONTINUE;
+}
+
+static int glibc_namecompare (const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static uint64_t glibc_now (void) {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void glibc_pushtm (lua_State *L, struct tm *tm) {
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, tm->tm_year + 1900);
+	lua_setfield(L, -2, "year");
+	lua_pushinteger(L, tm->tm_mon + 1);
+	lua_setfield(L, -2, "month");
+	lua_pushinteger(L, tm->tm_mday);
+	lua_setfield(L, -2, "day");
+	lua_pushinteger(L, tm->tm_hour);
+	lua_setfield(L, -2, "hour");
+	lua_pushinteger(L, tm->tm_min);
+	lua_setfield(L, -2, "min");
+	lua_pushinteger(L, tm->tm_sec);
+	lua_setfield(L, -2, "sec");
+	lua_pushboolean(L, tm->tm_isdst > 0);
+	lua_setfield(L, -2, "isdst");
+}
+
+static void glibc_mismatch (const char *zone, int function, int64_t t, size_t *count,
+		const char *expected, const char *actual) {
+	if (++(*count) <= GLIBC_DETAILS) {
+		printf("%s %s %lld: glibc '%s', lua-tz '%s'\n", zone, glibc_functions[function],
+				(long long)t, expected, actual);
+	}
+}
+
+static void glibc_compare (lua_State *L, const char *zone, int64_t from, int64_t to, int64_t step,
+		struct glibc_totals *totals) {
+	char         expected[128], actual[128];
+	size_t       counts[3] = { 0, 0, 0 };
+	time_t       tt, mt;
+	int64_t      t, lt;
+	struct tm    tm, mtm;
+	const char  *s;
+
+	for (t = from; t < to; t += step) {
+		tt = t;
+		if (!localtime_r(&tt, &tm)) {
+			continue;
+		}
+		totals->samples++;
+
+		/* tz.info: offset, DST flag, and abbreviation */
+		lua_pushvalue(L, GLIBC_INFO);
+		lua_pushinteger(L, t);
+		lua_pushstring(L, zone);
+		lua_call(L, 2, 3);
+		snprintf(expected, sizeof(expected), "%ld %d %s", tm.tm_gmtoff, tm.tm_isdst > 0,
+				tm.tm_zone);
+		snprintf(actual, sizeof(actual), "%ld %d %s", (long)lua_tointeger(L, -3),
+				lua_toboolean(L, -2), lua_tostring(L, -1));
+		lua_pop(L, 3);
+		if (strcmp(expected, actual) != 0) {
+			glibc_mismatch(zone, 0, t, &counts[0], expected, actual);
+		}
+
+		/* tz.date: formatted local time */
+		lua_pushvalue(L, GLIBC_DATE);
+		lua_pushstring(L, GLIBC_FORMAT);
+		lua_pushinteger(L, t);
+		lua_pushstring(L, zone);
+		lua_call(L, 3, 1);
+		strftime(expected, sizeof(expected), GLIBC_FORMAT, &tm);
+		s = lua_tostring(L, -1);
+		if (!s || strcmp(expected, s) != 0) {
+			glibc_mismatch(zone, 1, t, &counts[1], expected, s ? s : "nil");
+		}
+		lua_pop(L, 1);
+
+		/* tz.time: local time back to UTC, with the DST flag resolving ambiguity */
+		mtm = tm;
+		mt = mktime(&mtm);
+		lua_pushvalue(L, GLIBC_TIME);
+		glibc_pushtm(L, &tm);
+		lua_pushstring(L, zone);
+		lua_call(L, 2, 1);
+		lt = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (lt != (int64_t)mt) {
+			snprintf(expected, sizeof(expected), "%lld", (long long)mt);
+			snprintf(actual, sizeof(actual), "%lld", (long long)lt);
+			glibc_mismatch(zone, 2, t, &counts[2], expected, actual);
+		}
+	}
+	totals->mismatches[0] += counts[0];
+	totals->mismatches[1] += counts[1];
+	totals->mismatches[2] += counts[2];
+	if (counts[0] || counts[1] || counts[2]) {
+		printf("%s: %zu info, %zu date, %zu time mismatches\n", zone, counts[0], counts[1],
+				counts[2]);
+	}
+}
+
+static void glibc_measure (lua_State *L, const char *zone, int64_t from, int64_t to, int64_t step,
+		struct glibc_totals *totals) {
+	char       buffer[128];
+	time_t     tt;
+	int64_t    t;
+	uint64_t   start;
+	struct tm  tm;
+
+	/* tz.info versus localtime_r */
+	start = glibc_now();
+	for (t = from; t < to; t += step) {
+		lua_pushvalue(L, GLIBC_INFO);
+		lua_pushinteger(L, t);
+		lua_pushstring(L, zone);
+		lua_call(L, 2, 3);
+		lua_pop(L, 3);
+	}
+	totals->tz[0] += glibc_now() - start;
+	start = glibc_now();
+	for (t = from; t < to; t += step) {
+		tt = t;
+		localtime_r(&tt, &tm);
+	}
+	totals->libc[0] += glibc_now() - start;
+
+	/* tz.date versus localtime_r and strftime */
+	start = glibc_now();
+	for (t = from; t < to; t += step) {
+		lua_pushvalue(L, GLIBC_DATE);
+		lua_pushstring(L, GLIBC_FORMAT);
+		lua_pushinteger(L, t);
+		lua_pushstring(L, zone);
+		lua_call(L, 3, 1);
+		lua_pop(L, 1);
+	}
+	totals->tz[1] += glibc_now() - start;
+	start = glibc_now();
+	for (t = from; t < to; t += step) {
+		tt = t;
+		localtime_r(&tt, &tm);
+		strftime(buffer, sizeof(buffer), GLIBC_FORMAT, &tm);
+	}
+	totals->libc[1] += glibc_now() - start;
+
+	/* tz.time versus mktime, including argument preparation */
+	start = glibc_now();
+	for (t = from; t < to; t += step) {
+		tt = t;
+		gmtime_r(&tt, &tm);
+		lua_pushvalue(L, GLIBC_TIME);
+		glibc_pushtm(L, &tm);
+		lua_pushstring(L, zone);
+		lua_call(L, 2, 1);
+		lua_pop(L, 1);
+	}
+	totals->tz[2] += glibc_now() - start;
+	start = glibc_now();
+	for (t = from; t < to; t += step) {
+		tt = t;
+		gmtime_r(&tt, &tm);
+		tm.tm_isdst = 0;
+		mktime(&tm);
+	}
+	totals->libc[2] += glibc_now() - start;
+}
+
+int main (int argc, char *argv[]) {
+	int                   opt, i;
+	size_t                z;
+	int64_t               from, to, step;
+	lua_State            *L;
+	struct glibc_totals   totals;
+
+	/* arguments */
+	from = GLIBC_FROM;
+	to = GLIBC_TO;
+	step = GLIBC_STEP;
+	while ((opt = getopt(argc, argv, "f:t:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			from = strtoll(optarg, NULL, 10);
+			break;
+
+		case 't':
+			to = strtoll(optarg, NULL, 10);
+			break;
+
+		case 's':
+			step = strtoll(optarg, NULL, 10);
+			break;
+
+		default:
+			fprintf(stderr, "usage: %s [-f from] [-t to] [-s step] [timezone ...]\n",
+					argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (step < 1 || to <= from) {
+		fprintf(stderr, "invalid sweep\n");
+		return EXIT_FAILURE;
+	}
+
+	/* time zones */
+	if (optind < argc) {
+		glibc_list.names = &argv[optind];
+		glibc_list.cnt = argc - optind;
+	} else {
+		if (nftw(TZ_ZONEINFO, glibc_collect, 16, FTW_PHYS | FTW_ACTIONRETVAL) != 0) {
+			fprintf(stderr, "cannot list time zones in '%s'\n", TZ_ZONEINFO);
+			return EXIT_FAILURE;
+		}
+		qsort(glibc_list.names, glibc_list.cnt, sizeof(char *), glibc_namecompare);
+	}
+
+	/* set up Lua state */
+	L = luaL_newstate();
+	luaL_openlibs(L);
+#if LUA_VERSION_NUM >= 502
+	luaL_requiref(L, "tz", luaopen_tz, 1);
+#else
+	lua_pushcfunction(L, luaopen_tz);
+	lua_pushstring(L, "tz");
+	lua_call(L, 1, 1);
+#endif
+	for (i = 0; i < 3; i++) {
+		lua_getfield(L, 1, glibc_functions[i]);
+	}
+
+	/* compare and measure */
+	memset(&totals, 0, sizeof(totals));
+	for (z = 0; z < glibc_list.cnt; z++) {
+		if (setenv("TZ", glibc_list.names[z], 1) != 0) {
+			continue;
+		}
+		tzset();
+		lua_pushvalue(L, GLIBC_INFO);
+		lua_pushinteger(L, 0);
+		lua_pushstring(L, glibc_list.names[z]);
+		if (lua_pcall(L, 2, 0, 0) != 0) {
+			printf("%s: %s\n", glibc_list.names[z], lua_tostring(L, -1));
+			lua_pop(L, 1);
+			continue;
+		}
+		totals.zones++;
+		glibc_compare(L, glibc_list.names[z], from, to, step, &totals);
+		glibc_measure(L, glibc_list.names[z], from, to, step, &totals);
+	}
+
+	/* report */
+	printf("%zu zones, %zu samples, %zu info, %zu date, %zu time mismatches\n", totals.zones,
+			totals.samples, totals.mismatches[0], totals.mismatches[1], totals.mismatches[2]);
+	printf("%-10s %12s %12s %10s\n", "function", "lua-tz ns", "glibc ns", "speedup");
+	for (i = 0; i < 3; i++) {
+		if (totals.samples) {
+			printf("%-10s %12.1f %12.1f %9.2fx\n", glibc_functions[i],
+					(double)totals.tz[i] / totals.samples,
+					(double)totals.libc[i] / totals.samples,
+					totals.tz[i] ? (double)totals.libc[i] / totals.tz[i] : 0.0);
+		}
+	}
+	lua_close(L);
+	return totals.mismatches[0] || totals.mismatches[1] || totals.mismatches[2]
+			? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,325 @@
+/*
+ * Lua TZ
+ *
+ * Copyright (C) 2014-2023 Andre Naef
+ */
+
+
+#include "../src/tz.h"
+#include <lauxlib.h>
+#include <lualib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+
+#define REPLAY_KINDS 5  /* record kinds, indexed by TZ_TRACE_* */
+
+#if LUA_VERSION_NUM >= 503
+#define replay_pushtime lua_pushinteger
+#else
+#define replay_pushtime lua_pushnumber
+#endif
+
+
+struct replay_string {
+	const char  *s;
+	uint16_t     len;
+};
+
+struct replay_call {
+	int       kind;
+	int64_t   t;
+	uint16_t  zone, format;
+	int32_t   fields[TZ_TRACE_FIELDS];
+};
+
+struct replay_stats {
+	const char  *name;
+	size_t       count, errors;
+	uint64_t    *samples;
+	uint64_t     total;
+};
+
+
+static unsigned char *replay_read(const char *filename, size_t *size);
+static int replay_parse(unsigned char *buffer, size_t size, struct replay_string *strings,
+		struct replay_call **calls, size_t *callcnt);
+static uint64_t replay_now(void);
+static void replay_push(lua_State *L, struct replay_string *strings, struct replay_call *call);
+static int replay_compare(const void *a, const void *b);
+static void replay_report(struct replay_stats *stats, double seconds);
+
+
+static unsigned char *replay_read (const char *filename, size_t *size) {
+	FILE           *f;
+	long            len;
+	unsigned char  *buffer;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	buffer = malloc(len > 0 ? len : 1);
+	if (!buffer || fread(buffer, 1, len, f) != (size_t)len) {
+		free(buffer);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*size = len;
+	return buffer;
+}
+
+static int replay_parse (unsigned char *buffer, size_t size, struct replay_string *strings,
+		struct replay_call **calls, size_t *callcnt) {
+	size_t               pos, need, alloc;
+	uint16_t             id, len;
+	uint32_t             mark;
+	struct replay_call  *call;
+
+	/* header */
+	if (size < 9 || memcmp(buffer, TZ_TRACE_MAGIC, 4) != 0 || buffer[4] != TZ_TRACE_VERSION) {
+		return -1;
+	}
+	memcpy(&mark, &buffer[5], sizeof(mark));
+	if (mark != TZ_TRACE_MARK) {
+		return -1;
+	}
+
+	/* records */
+	pos = 9;
+	alloc = 0;
+	*calls = NULL;
+	*callcnt = 0;
+	while (pos < size) {
+		switch (buffer[pos]) {
+		case TZ_TRACE_STRING:
+			if (pos + 5 > size) {
+				return -1;
+			}
+			memcpy(&id, &buffer[pos + 1], sizeof(id));
+			memcpy(&len, &buffer[pos + 3], sizeof(len));
+			if (pos + 5 + len > size) {
+				return -1;
+			}
+			strings[id].s = (const char *)&buffer[pos + 5];
+			strings[id].len = len;
+			pos += 5 + len;
+			continue;
+
+		case TZ_TRACE_INFO:
+			need = 1 + 8 + 2;
+			break;
+
+		case TZ_TRACE_DATE:
+			need = 1 + 8 + 2 + 2;
+			break;
+
+		case TZ_TRACE_TIME:
+			need = 1 + 2 + TZ_TRACE_FIELDS * sizeof(int32_t);
+			break;
+
+		default:
+			return -1;
+		}
+		if (pos + need > size) {
+			return -1;
+		}
+		if (*callcnt == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			call = realloc(*calls, alloc * sizeof(struct replay_call));
+			if (!call) {
+				return -1;
+			}
+			*calls = call;
+		}
+		call = &(*calls)[(*callcnt)++];
+		memset(call, 0, sizeof(struct replay_call));
+		call->kind = buffer[pos++];
+		if (call->kind != TZ_TRACE_TIME) {
+			memcpy(&call->t, &buffer[pos], sizeof(call->t));
+			pos += sizeof(call->t);
+		}
+		memcpy(&call->zone, &buffer[pos], sizeof(call->zone));
+		pos += sizeof(call->zone);
+		if (call->kind == TZ_TRACE_DATE) {
+			memcpy(&call->format, &buffer[pos], sizeof(call->format));
+			pos += sizeof(call->format);
+		}
+		if (call->kind == TZ_TRACE_TIME) {
+			memcpy(call->fields, &buffer[pos], sizeof(call->fields));
+			pos += sizeof(call->fields);
+		}
+	}
+	return 0;
+}
+
+static uint64_t replay_now (void) {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void replay_push (lua_State *L, struct replay_string *strings, struct replay_call *call) {
+	static const char  *names[] = { "year", "month", "day", "hour", "min", "sec" };
+	int                 i;
+
+	switch (call->kind) {
+	case TZ_TRACE_INFO:
+		replay_pushtime(L, call->t);
+		lua_pushlstring(L, strings[call->zone].s, strings[call->zone].len);
+		break;
+
+	case TZ_TRACE_DATE:
+		lua_pushlstring(L, strings[call->format].s, strings[call->format].len);
+		replay_pushtime(L, call->t);
+		lua_pushlstring(L, strings[call->zone].s, strings[call->zone].len);
+		break;
+
+	case TZ_TRACE_TIME:
+		lua_newtable(L);
+		for (i = 0; i < 6; i++) {
+			lua_pushinteger(L, call->fields[i]);
+			lua_setfield(L, -2, names[i]);
+		}
+		if (call->fields[6] >= 0) {
+			lua_pushboolean(L, call->fields[6]);
+			lua_setfield(L, -2, "isdst");
+		}
+		if (call->fields[7] & 2) {
+			lua_pushinteger(L, call->fields[8]);
+			lua_setfield(L, -2, "off");
+		}
+		if (call->fields[7] & 1) {
+			lua_pushlstring(L, strings[call->zone].s, strings[call->zone].len);
+		} else {
+			lua_pushnil(L);  /* the off field applies only without a time zone argument */
+		}
+		break;
+	}
+}
+
+static int replay_compare (const void *a, const void *b) {
+	uint64_t  x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void replay_report (struct replay_stats *stats, double seconds) {
+	size_t  n;
+
+	n = stats->count;
+	if (n == 0) {
+		return;
+	}
+	qsort(stats->samples, n, sizeof(uint64_t), replay_compare);
+	printf("%-10s %10zu %8zu %10.1f %8llu %8llu %8llu %8llu %10llu %12.0f\n", stats->name, n,
+			stats->errors, (double)stats->total / n,
+			(unsigned long long)stats->samples[n / 2],
+			(unsigned long long)stats->samples[n * 90 / 100],
+			(unsigned long long)stats->samples[n * 99 / 100],
+			(unsigned long long)stats->samples[n * 999 / 1000],
+			(unsigned long long)stats->samples[n - 1], n / seconds);
+}
+
+int main (int argc, char *argv[]) {
+	int                    rounds, round, kind;
+	size_t                 size, callcnt, c;
+	uint64_t               start, end, elapsed, total;
+	lua_State             *L;
+	unsigned char         *buffer;
+	struct replay_call    *calls;
+	struct replay_stats    stats[REPLAY_KINDS];
+	struct replay_string  *strings;
+	static const char     *functions[REPLAY_KINDS] = { NULL, NULL, "info", "date", "time" };
+
+	/* arguments */
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s trace [rounds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	rounds = argc == 3 ? atoi(argv[2]) : 1;
+	if (rounds < 1) {
+		fprintf(stderr, "invalid rounds '%s'\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	/* read trace */
+	buffer = replay_read(argv[1], &size);
+	if (!buffer) {
+		fprintf(stderr, "cannot read trace file '%s'\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	strings = calloc(UINT16_MAX + 1, sizeof(struct replay_string));
+	if (!strings || replay_parse(buffer, size, strings, &calls, &callcnt) != 0) {
+		fprintf(stderr, "invalid trace file '%s'\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	/* set up Lua state */
+	L = luaL_newstate();
+	luaL_openlibs(L);
+#if LUA_VERSION_NUM >= 502
+	luaL_requiref(L, "tz", luaopen_tz, 1);
+#else
+	lua_pushcfunction(L, luaopen_tz);
+	lua_pushstring(L, "tz");
+	lua_call(L, 1, 1);
+#endif
+	for (kind = TZ_TRACE_INFO; kind <= TZ_TRACE_TIME; kind++) {
+		lua_getfield(L, 1, functions[kind]);  /* stack index equals kind */
+	}
+	memset(stats, 0, sizeof(stats));
+	for (kind = TZ_TRACE_INFO; kind <= TZ_TRACE_TIME; kind++) {
+		stats[kind].name = functions[kind];
+		stats[kind].samples = malloc((callcnt * rounds + 1) * sizeof(uint64_t));
+		if (!stats[kind].samples) {
+			fprintf(stderr, "out of memory\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* replay */
+	total = 0;
+	for (round = 0; round < rounds; round++) {
+		for (c = 0; c < callcnt; c++) {
+			kind = calls[c].kind;
+			lua_pushvalue(L, kind);
+			replay_push(L, strings, &calls[c]);
+			start = replay_now();
+			if (lua_pcall(L, kind == TZ_TRACE_DATE ? 3 : 2, 0, 0) != 0) {
+				stats[kind].errors++;
+				lua_pop(L, 1);
+			}
+			end = replay_now();
+			elapsed = end - start;
+			stats[kind].samples[stats[kind].count++] = elapsed;
+			stats[kind].total += elapsed;
+			total += elapsed;
+		}
+	}
+
+	/* report */
+	printf("%zu calls, %d round(s), %.3f ms in calls\n", callcnt, rounds, total / 1e6);
+	printf("%-10s %10s %8s %10s %8s %8s %8s %8s %10s %12s\n", "function", "calls", "errors",
+			"mean ns", "p50", "p90", "p99", "p99.9", "max", "calls/s");
+	for (kind = TZ_TRACE_INFO; kind <= TZ_TRACE_TIME; kind++) {
+		replay_report(&stats[kind], stats[kind].total / 1e9);
+		free(stats[kind].samples);
+	}
+	lua_close(L);
+	free(calls);
+	free(strings);
+	free(buffer);
+	return EXIT_SUCCESS;
+}
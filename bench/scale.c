@@ -0,0 +1,275 @@
+/*
+ * Lua TZ
+ *
+ * Copyright (C) 2014-2023 Andre Naef
+ */
+
+
+#include "../src/tz.h"
+#include <lauxlib.h>
+#include <lualib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+#define SCALE_DURATION  1          /* default seconds per thread count */
+#define SCALE_BUCKETS   10000      /* latency histogram buckets */
+#define SCALE_BUCKET    10         /* nanoseconds per bucket */
+#define SCALE_FROM      0          /* start of random times (1970-01-01) */
+#define SCALE_SPAN      2145916800 /* span of random times (to 2038-01-01) */
+#define SCALE_DATE      2          /* stack index of tz.date */
+#define SCALE_TIME      3          /* stack index of tz.time */
+
+
+struct scale_thread {
+	pthread_t  thread;
+	uint64_t   seed;
+	uint64_t   load;                            /* nanoseconds to load the zone mix */
+	uint64_t   ops, max;
+	uint64_t   histogram[SCALE_BUCKETS + 1];    /* last bucket counts overflows */
+	int        failed;
+} __attribute__((aligned(64)));                  /* no false sharing among threads */
+
+
+/* zone mix, weighted by repetition */
+static const char *scale_zones[] = {
+	"UTC", "UTC", "UTC", "UTC",
+	"America/New_York", "America/New_York", "America/New_York",
+	"Europe/London", "Europe/London", "Europe/Berlin", "Europe/Berlin",
+	"America/Chicago", "America/Los_Angeles", "America/Los_Angeles",
+	"Asia/Tokyo", "Asia/Tokyo", "Asia/Shanghai", "Asia/Kolkata", "Asia/Singapore",
+	"Australia/Sydney", "America/Sao_Paulo", "Europe/Paris", "Europe/Zurich",
+	"Asia/Dubai", "Africa/Johannesburg", "America/Toronto", "Pacific/Auckland",
+	"Asia/Kathmandu", "America/St_Johns", "Australia/Lord_Howe"
+};
+#define SCALE_ZONES (sizeof(scale_zones) / sizeof(scale_zones[0]))
+
+static pthread_barrier_t  scale_barrier;
+static volatile int       scale_stop;
+
+
+static uint64_t scale_now(void);
+static uint64_t scale_random(uint64_t *seed);
+static void scale_record(struct scale_thread *thread, uint64_t elapsed);
+static void *scale_run(void *arg);
+static uint64_t scale_percentile(uint64_t *histogram, uint64_t ops, double p);
+
+
+static uint64_t scale_now (void) {
+	struct timespec  ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t scale_random (uint64_t *seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+static void scale_record (struct scale_thread *thread, uint64_t elapsed) {
+	uint64_t  bucket;
+
+	bucket = elapsed / SCALE_BUCKET;
+	thread->histogram[bucket < SCALE_BUCKETS ? bucket : SCALE_BUCKETS]++;
+	if (elapsed > thread->max) {
+		thread->max = elapsed;
+	}
+	thread->ops++;
+}
+
+static void *scale_run (void *arg) {
+	size_t                z;
+	int64_t               t;
+	uint64_t              start, r;
+	lua_State            *L;
+	struct scale_thread  *thread;
+
+	/* set up Lua state */
+	thread = arg;
+	L = luaL_newstate();
+	luaL_openlibs(L);
+#if LUA_VERSION_NUM >= 502
+	luaL_requiref(L, "tz", luaopen_tz, 1);
+#else
+	lua_pushcfunction(L, luaopen_tz);
+	lua_pushstring(L, "tz");
+	lua_call(L, 1, 1);
+#endif
+	lua_getfield(L, 1, "date");
+	lua_getfield(L, 1, "time");
+	lua_newtable(L);
+
+	/* load the zone mix concurrently with the other threads */
+	pthread_barrier_wait(&scale_barrier);
+	start = scale_now();
+	for (z = 0; z < SCALE_ZONES; z++) {
+		lua_pushvalue(L, SCALE_DATE);
+		lua_pushliteral(L, "%Y");
+		lua_pushinteger(L, 0);
+		lua_pushstring(L, scale_zones[z]);
+		if (lua_pcall(L, 3, 0, 0) != 0) {
+			fprintf(stderr, "%s\n", lua_tostring(L, -1));
+			thread->failed = 1;
+			lua_pop(L, 1);
+		}
+	}
+	thread->load = scale_now() - start;
+
+	/* alternate tz.date and tz.time */
+	pthread_barrier_wait(&scale_barrier);
+	while (!scale_stop && !thread->failed) {
+		r = scale_random(&thread->seed);
+		z = r % SCALE_ZONES;
+		t = SCALE_FROM + (int64_t)((r >> 16) % SCALE_SPAN);
+		if (r & 0x8000) {
+			lua_pushvalue(L, SCALE_DATE);
+			lua_pushliteral(L, "%Y-%m-%d %H:%M:%S");
+			lua_pushinteger(L, t);
+			lua_pushstring(L, scale_zones[z]);
+			start = scale_now();
+			lua_call(L, 3, 1);
+		} else {
+			lua_pushinteger(L, 1970 + t / 31556952);
+			lua_setfield(L, 4, "year");
+			lua_pushinteger(L, 1 + t % 12);
+			lua_setfield(L, 4, "month");
+			lua_pushinteger(L, 1 + t % 28);
+			lua_setfield(L, 4, "day");
+			lua_pushinteger(L, t % 24);
+			lua_setfield(L, 4, "hour");
+			lua_pushvalue(L, SCALE_TIME);
+			lua_pushvalue(L, 4);
+			lua_pushstring(L, scale_zones[z]);
+			start = scale_now();
+			lua_call(L, 2, 1);
+		}
+		scale_record(thread, scale_now() - start);
+		lua_pop(L, 1);
+	}
+	lua_close(L);
+	return NULL;
+}
+
+static uint64_t scale_percentile (uint64_t *histogram, uint64_t ops, double p) {
+	size_t    b;
+	uint64_t  count, target;
+
+	target = (uint64_t)(ops * p);
+	count = 0;
+	for (b = 0; b < SCALE_BUCKETS; b++) {
+		count += histogram[b];
+		if (count > target) {
+			return (b + 1) * SCALE_BUCKET;
+		}
+	}
+	return SCALE_BUCKETS * SCALE_BUCKET;
+}
+
+int main (int argc, char *argv[]) {
+	int                   opt, duration, n, i, j, counts[64], countcnt, failed;
+	size_t                b;
+	uint64_t              ops, max, load, histogram[SCALE_BUCKETS + 1];
+	double                rate, base;
+	struct scale_thread  *threads;
+
+	/* arguments */
+	duration = SCALE_DURATION;
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = atoi(optarg);
+			break;
+
+		default:
+			fprintf(stderr, "usage: %s [-d seconds] [threads ...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	countcnt = 0;
+	for (i = optind; i < argc && countcnt < 64; i++) {
+		counts[countcnt++] = atoi(argv[i]);
+	}
+	if (countcnt == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		for (i = 1; countcnt < 64; i *= 2) {
+			counts[countcnt++] = i < n ? i : n;
+			if (i >= n) {
+				break;
+			}
+		}
+	}
+	if (duration < 1) {
+		fprintf(stderr, "invalid duration\n");
+		return EXIT_FAILURE;
+	}
+
+	/* run each thread count */
+	printf("%7s %9s %12s %12s %12s %8s %8s %8s %10s\n", "threads", "load ms", "calls/s",
+			"per thread", "efficiency", "p50 ns", "p99", "p99.9", "max");
+	base = 0;
+	failed = 0;
+	for (i = 0; i < countcnt; i++) {
+		n = counts[i];
+		if (n < 1) {
+			fprintf(stderr, "invalid thread count %d\n", n);
+			return EXIT_FAILURE;
+		}
+		if (posix_memalign((void **)&threads, 64, n * sizeof(struct scale_thread)) != 0) {
+			fprintf(stderr, "out of memory\n");
+			return EXIT_FAILURE;
+		}
+		memset(threads, 0, n * sizeof(struct scale_thread));
+		pthread_barrier_init(&scale_barrier, NULL, n + 1);
+		scale_stop = 0;
+		for (j = 0; j < n; j++) {
+			threads[j].seed = 0x9e3779b97f4a7c15ULL * (j + 1);
+			if (pthread_create(&threads[j].thread, NULL, scale_run, &threads[j]) != 0) {
+				fprintf(stderr, "cannot create thread\n");
+				return EXIT_FAILURE;
+			}
+		}
+		pthread_barrier_wait(&scale_barrier);  /* load */
+		pthread_barrier_wait(&scale_barrier);  /* run */
+		sleep(duration);
+		scale_stop = 1;
+		memset(histogram, 0, sizeof(histogram));
+		ops = max = load = 0;
+		for (j = 0; j < n; j++) {
+			pthread_join(threads[j].thread, NULL);
+			for (b = 0; b <= SCALE_BUCKETS; b++) {
+				histogram[b] += threads[j].histogram[b];
+			}
+			ops += threads[j].ops;
+			if (threads[j].max > max) {
+				max = threads[j].max;
+			}
+			if (threads[j].load > load) {
+				load = threads[j].load;
+			}
+			failed |= threads[j].failed;
+		}
+		pthread_barrier_destroy(&scale_barrier);
+		free(threads);
+
+		/* report */
+		rate = (double)ops / duration;
+		if (i == 0) {
+			base = rate / n;
+		}
+		printf("%7d %9.2f %12.0f %12.0f %11.0f%% %8llu %8llu %8llu %10llu\n", n, load / 1e6,
+				rate, rate / n, base > 0 ? rate / n / base * 100 : 0.0,
+				(unsigned long long)scale_percentile(histogram, ops, 0.5),
+				(unsigned long long)scale_percentile(histogram, ops, 0.99),
+				(unsigned long long)scale_percentile(histogram, ops, 0.999),
+				(unsigned long long)max);
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -12,25 +12,127 @@
 #include <libkern/OSByteOrder.h>
 #define be32toh OSSwapBigToHostInt32
 #define be64toh OSSwapBigToHostInt64
+#define htobe32 OSSwapHostToBigInt32
+#define htobe64 OSSwapHostToBigInt64
 #else
 #include <endian.h>
 #endif
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
 #include <ctype.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dlfcn.h>
 #include <lauxlib.h>
+#ifdef TZ_USDT
+#include <sys/sdt.h>
+#endif
 
 
 #define TZ_TYPE_PACKED  (size_t)(6)
+#define TZ_FILENAME_MAX 128                         /* maximum filename length */
+#define TZ_TRACE_RECORD_MAX 64                      /* maximum trace record length */
+#define TZ_FOOTER_FIXED     64                      /* fixed-offset footer buffer size */
+#define TZ_STRATEGY_CONST   0                       /* no transitions */
+#define TZ_STRATEGY_LINEAR  1                       /* backward scan from the last transition */
+#define TZ_STRATEGY_BUCKET  2                       /* bucket index and binary search */
+#define TZ_LINEAR_MAX       1                       /* maximum transitions for linear scan */
+#define TZ_BUCKETS          256                     /* bucket index size */
+#define TZ_GROUP            8                       /* searches advanced in lockstep */
+#if defined(__GNUC__)
+#define TZ_PREFETCH(p)      __builtin_prefetch(p)
+#define TZ_TRACING()        __atomic_load_n(&tz_tracing, __ATOMIC_RELAXED)
+#define TZ_TRACING_ADD(n)   __atomic_fetch_add(&tz_tracing, (n), __ATOMIC_RELAXED)
+#else
+#define TZ_PREFETCH(p)      ((void)(p))
+#define TZ_TRACING()        (tz_tracing)
+#define TZ_TRACING_ADD(n)   (tz_tracing += (n))
+#endif
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(TZ_NOSIMD)
+#define TZ_SIMD             1
+#include <immintrin.h>
+#else
+#define TZ_SIMD             0
+#endif
+#define TZ_SIMD_NONE        0                       /* scalar kernels */
+#define TZ_SIMD_AVX2        1                       /* AVX2 kernels, four lanes */
+#define TZ_SIMD_MAX         ((int64_t)1 << 40)      /* exclusive limit of SIMD times */
+#define TZ_BATCH_CHUNK      256                     /* times per chunk of a batch */
+#define TZ_ISO_LENGTH       25                      /* YYYY-MM-DDTHH:MM:SS+HH:MM */
+#define TZ_ISO_MIN          (int64_t)-62167219200   /* 0000-01-01T00:00:00 */
+#define TZ_ISO_LOCAL        19                      /* YYYY-MM-DDTHH:MM:SS */
+#define TZ_ISO_MAX          (int64_t)253402300800   /* 10000-01-01T00:00:00, exclusive */
+#define TZ_WEEK         (int64_t)(7 * 86400)         /* seconds per week */
+#define TZ_HORIZON      (int64_t)(2 * 366 * 86400)   /* schedule search horizon */
+
+#define TZ_UNIT_YEAR   0
+#define TZ_UNIT_MONTH  1
+#define TZ_UNIT_WEEK   2
+#define TZ_UNIT_DAY    3
+#define TZ_UNIT_HOUR   4
+#define TZ_UNIT_MIN    5
+#define TZ_UNIT_SEC    6
+
+#define TZ_PERIOD_YEAR   0
+#define TZ_PERIOD_MONTH  1
+#define TZ_PERIOD_DAY    2
+#define TZ_PERIOD_HOUR   3
+#define TZ_PERIODS       4
+
+#define TZ_REPEAT_NONE   0
+#define TZ_REPEAT_YEAR   1
+#define TZ_REPEAT_MONTH  2
+#define TZ_REPEAT_WEEK   3
+#define TZ_REPEAT_DAY    4
+#define TZ_TIMERZONE_MAX 65535  /* maximum time zones per timer queue */
+
+#define TZ_INTERVAL_START_END       0
+#define TZ_INTERVAL_START_DURATION  1
+#define TZ_INTERVAL_DURATION_END    2
+#define TZ_DURATION_DIGITS          9  /* maximum digits per duration component */
+
+#define TZ_RESOLVE_LENGTH  128  /* maximum length of a relative date expression */
+#define TZ_RESOLVE_TOKENS  16   /* maximum words of a relative date expression */
+
+#define TZ_SCALE_UNIX   0
+#define TZ_SCALE_EXCEL  1
+#define TZ_SCALE_JD     2
+#define TZ_SCALE_MJD    3
+#define TZ_SCALE_GPS    4
+#define TZ_SCALE_NTP    5
+#define TZ_EXCEL_EPOCH  25569      /* Excel serial of epoch (1900 date system) */
+#define TZ_MJD_EPOCH    40587      /* Modified Julian Date of epoch */
+#define TZ_GPS_EPOCH    315964800  /* time of GPS epoch (January 6, 1980) */
+#define TZ_GPS_TAI      19         /* TAI minus GPS time, in seconds */
+#define TZ_NTP_EPOCH    2208988800 /* seconds from NTP epoch (January 1, 1900) to epoch */
+
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen  lua_objlen
+#endif
+
+#ifdef TZ_USDT
+#define TZ_PROBE1(name, a)        DTRACE_PROBE1(lua_tz, name, a)
+#define TZ_PROBE2(name, a, b)     DTRACE_PROBE2(lua_tz, name, a, b)
+#define TZ_PROBE3(name, a, b, c)  DTRACE_PROBE3(lua_tz, name, a, b, c)
+#else
+#define TZ_PROBE1(name, a)        ((void)(a))
+#define TZ_PROBE2(name, a, b)     ((void)(a), (void)(b))
+#define TZ_PROBE3(name, a, b, c)  ((void)(a), (void)(b), (void)(c))
+#endif
 
 
 struct tz_header {
 	char     magic[4];
 	char     version;
-	char     reserved[15];
+	char     reserved[11];
+	int32_t  footercnt;  /* footer length, in memory only; reserved in TZ files */
 	int32_t  isgmtcnt;
 	int32_t  isstdcnt;
 	int32_t  leapcnt;
@@ -45,18 +147,187 @@ struct tz_type {
 	uint8_t  abbrind;
 };
 
+struct tz_period {
+	int64_t  from, to;  /* UTC range of the cached local period */
+	int64_t  key;       /* numeric date key, e.g., 20261016 */
+	int      pathlen;
+	char     path[64];  /* partition path, e.g., year=2026/month=10/day=16 */
+};
+
 struct tz_data {
 	struct tz_header  header;
-	int64_t          *timevalues;  /* header.timecnt */
-	uint8_t          *timetypes;   /* header.timecnt */
-	struct tz_type   *types;       /* header.typecnt */
-	char             *chars;       /* header.charcnt */
+	void             *block;                    /* allocation holding the arrays */
+	int64_t          *timevalues;               /* header.timecnt */
+	uint8_t          *timetypes;                /* header.timecnt */
+	struct tz_type   *types;                    /* header.typecnt */
+	char             *chars;                    /* header.charcnt */
+	char             *footer;                   /* header.footercnt, POSIX TZ string */
+	int               strategy;                 /* TZ_STRATEGY_* */
+	int               shift;                    /* log2 of bucket width in seconds */
+	int64_t           base;                     /* start of first bucket */
+	int32_t           buckets[TZ_BUCKETS + 1];  /* first transition per bucket */
+	struct tz_period  periods[TZ_PERIODS];      /* last period per granularity */
+	int               mapped;                   /* block points into a cache bundle */
+};
+
+struct tz_image {
+	char              magic[4];   /* TZ_IMAGE_MAGIC */
+	uint8_t           version;    /* TZ_IMAGE_VERSION */
+	uint8_t           namelen;    /* length of the time zone name following the image header */
+	uint16_t          reserved;
+	uint32_t          mark;       /* TZ_IMAGE_MARK, detecting foreign byte order */
+	uint32_t          blocksize;  /* length of the data block following the name */
+	struct tz_header  header;     /* counts in host byte order */
+};
+
+struct tz_cachefile {
+	int64_t  mtime;  /* source file modification time */
+	int64_t  size;   /* source file size */
+	int64_t  ino;    /* source file inode */
+};
+
+struct tz_bundleheader {
+	char      magic[4];  /* TZ_BUNDLE_MAGIC */
+	uint8_t   version;   /* TZ_BUNDLE_VERSION */
+	uint8_t   reserved[3];
+	uint32_t  mark;      /* TZ_BUNDLE_MARK, detecting foreign byte order */
+	uint32_t  count;     /* entries, sorted by filename */
+	uint64_t  size;      /* file size */
+};
+
+struct tz_bundleentry {
+	char                 filename[TZ_FILENAME_MAX];  /* source TZ file */
+	struct tz_cachefile  source;
+	uint64_t             offset;                     /* data block, 8-byte aligned */
+	struct tz_header     header;                     /* counts in host byte order */
+};
+
+struct tz_bundleitem {
+	char                 filename[TZ_FILENAME_MAX];
+	struct tz_cachefile  source;
+	struct tz_data       data;
+};
+
+struct tz_bundle {
+	struct tz_bundle      *next;
+	char                   path[PATH_MAX];
+	void                  *map;      /* never unmapped, as TZ data may point into it */
+	size_t                 size;
+	int                    reopen;   /* map the file again on next use */
+	struct tz_bundleitem  *items;    /* zones parsed since the last write */
+	size_t                 itemcnt, itemalloc;
+};
+
+struct tz_trace {
+	FILE  *f;
+	int    strings;    /* registry reference to interned strings */
+	int    stringcnt;
+};
+
+struct tz_job {
+	struct tz_job   *next;
+	int              refs;          /* loaders */
+	pthread_t        thread;
+	int              done, failed;  /* guarded by tz_mutex */
+	int              detached;      /* released while pending; guarded by tz_mutex */
+	int              fds[2];        /* pipe, readable when done */
+	char             timezone[TZ_FILENAME_MAX];
+	char             filename[TZ_FILENAME_MAX];
+	char             bundle[PATH_MAX];  /* cache bundle, or empty */
+	struct tz_data   data;
+	char             error[256];
+};
+
+struct tz_loader {
+	struct tz_job   *job;          /* NULL when loaded */
+	char             timezone[TZ_FILENAME_MAX];
+};
+
+struct tz_fields {
+	int  sec, min, hour;
+	int  day, month, year;
+	int  wday, yday;
+};
+
+struct tz_exception {
+	int64_t  day;    /* days since epoch */
+	int      first;  /* first span */
+	int      count;  /* number of spans */
+};
+
+struct tz_schedule {
+	int                   ref;          /* TZ data reference */
+	struct tz_data       *data;
+	int                   weekcnt;
+	int32_t              *week;         /* weekcnt open/close pairs, seconds into week */
+	int                   exceptioncnt;
+	struct tz_exception  *exceptions;   /* exceptioncnt, sorted by day */
+	int                   spancnt;
+	int32_t              *spans;        /* spancnt open/close pairs, seconds into day */
+	int64_t               from, to;     /* cached window, UTC */
+	int                   cachecnt;
+	int64_t              *cache;        /* cachecnt open/close pairs, UTC */
+};
+
+struct tz_timer {
+	int64_t   due;     /* UTC */
+	int64_t   local;   /* first occurrence, local time */
+	int32_t   count;   /* occurrence, or next free slot if unused */
+	int32_t   pos;     /* heap position, or -1 if unused */
+	uint16_t  zone;
+	uint8_t   repeat;  /* TZ_REPEAT_* */
+};
+
+struct tz_timerzone {
+	int              ref;   /* TZ data reference */
+	struct tz_data  *data;
+};
+
+struct tz_timers {
+	int                   zones;      /* reference to table of zone indexes by name */
+	int                   zonecnt, zonealloc;
+	struct tz_timerzone  *zone;
+	int                   slotcnt;
+	struct tz_timer      *slots;      /* slotcnt timers, indexed by ID - 1 */
+	int                   free;       /* first free slot, or -1 */
+	int                   heapcnt;
+	int32_t              *heap;       /* heapcnt slots, ordered by due time */
+};
+
+struct tz_duration {
+	int64_t  months;  /* years and months, applied to the local date */
+	int64_t  days;    /* weeks and days, applied to the local date */
+	int64_t  secs;    /* hours, minutes, and seconds, elapsed */
+};
+
+struct tz_interval {
+	int                 mode;         /* TZ_INTERVAL_* */
+	int64_t             start, end;   /* anchors, as applicable */
+	struct tz_duration  duration;
+	int64_t             count;        /* occurrences, or -1 if unbounded */
+	int64_t             next;         /* next occurrence of an iterator */
+};
+
+struct tz_token {
+	const char  *s;
+	size_t       len;
 };
 
 
 static int getfield(lua_State *L, int index, const char *key, int d);
+static int getindex(lua_State *L, int index, int n);
+static int64_t gettime(lua_State *L, int index, int n);
 static inline void setfield(lua_State *L, const char *key, int value);
+static inline int64_t checktime(lua_State *L, int index);
+static inline int64_t opttime(lua_State *L, int index);
+static inline void pushtime(lua_State *L, int64_t t);
+static void pushinterval(lua_State *L, int64_t open, int64_t close);
 static inline int days(int year, int month);
+static inline int64_t epochday(int year, int month, int day);
+static inline int64_t floordiv(int64_t a, int64_t b);
+static inline int isotime(int year, int month, int day, int hour, int min, int sec, int64_t *t);
+static int isooffset(const char *p, size_t len, int32_t *off);
+static int isodigits(const char *p, int n);
 #if LUA_VERSION_NUM < 502
 void *luaL_testudata(lua_State *L, int index, const char *name);
 #endif
@@ -64,21 +335,230 @@ void *luaL_testudata(lua_State *L, int index, const char *name);
 static int tz_tostring(lua_State *L);
 static int tz_gc(lua_State *L);
 
-static void tz_readheader(lua_State *L, FILE *f, off_t size, struct tz_header *header);
-static void tz_read(lua_State *L, const char *filename, off_t size);
+static const char *tz_parseheader(const char **p, const char *end, struct tz_header *header);
+static const char *tz_checkheader(struct tz_header *header);
+static const char *tz_check(struct tz_data *data);
+static size_t tz_blocksize(struct tz_header *header);
+static void tz_layout(struct tz_data *data, void *block);
+static const char *tz_parse(const char *buffer, size_t size, struct tz_data *data);
+static int tz_loadfile(const char *filename, struct tz_data *data, char *error, size_t size,
+		off_t *bytes);
+static int tz_load(const char *filename, struct tz_data *data, char *error, size_t size);
+static void tz_read(lua_State *L, const char *filename);
+static void tz_cache(lua_State *L);
+static void tz_filename(lua_State *L, const char *timezone, size_t len, char *filename);
 static struct tz_data *tz_data(lua_State *L, const char *timezone, size_t len);
+static void tz_strategy(struct tz_data *data);
+static int tz_index(struct tz_data *data, int64_t t);
+static void tz_indexbatch(struct tz_data *data, const int64_t *t, int32_t *index, int n);
 static struct tz_type *tz_find(struct tz_data *data, int64_t t, int isdst, int reverse);
+static void tz_breakdown(int64_t t, struct tz_fields *fields);
+
+static void tz_simdinit(void);
+static void tz_breakdown_scalar(const int64_t *t, struct tz_fields *fields, int n);
+#if TZ_SIMD
+static void tz_breakdown_avx2(const int64_t *t, struct tz_fields *fields, int n);
+#endif
+static void tz_breakdownbatch(const int64_t *t, struct tz_fields *fields, int n);
+static void tz_iso_scalar(const struct tz_fields *fields, const int32_t *offsets, char *out,
+		int n);
+#if TZ_SIMD
+static void tz_iso_avx2(const struct tz_fields *fields, const int32_t *offsets, char *out, int n);
+#endif
+static void tz_isobatch(const struct tz_fields *fields, const int32_t *offsets, char *out, int n);
+static int tz_isoparse_scalar(const char *s, size_t width, int64_t *t, int n);
+#if TZ_SIMD
+static int tz_isoparse_avx2(const char *s, size_t width, int64_t *t, int n);
+#endif
+static int tz_isoparsebatch(const char *s, size_t width, int64_t *t, int n);
+
+static int tz_trace_tostring(lua_State *L);
+static int tz_trace_gc(lua_State *L);
+static struct tz_trace *tz_trace_get(lua_State *L);
+static int tz_trace_string(lua_State *L, struct tz_trace *trace, const char *s, size_t len);
+static void tz_trace_call(lua_State *L, int kind, int64_t t, const char *timezone, size_t len,
+		const char *format, int32_t *fields);
+static int tz_trace(lua_State *L);
+
+static const char *tz_image(const char *buffer, size_t size, struct tz_data *data,
+		const char **name, size_t *namelen);
+static void tz_imageheader(struct tz_image *image, struct tz_data *data, size_t namelen);
+static int tz_bundlepath(lua_State *L, char *path, size_t size);
+static void tz_bundlestamp(struct tz_cachefile *stamp, struct stat *source);
+static int tz_bundlecompare(const void *a, const void *b);
+static struct tz_bundle *tz_bundleget(const char *path);
+static int tz_bundleentry(void *map, size_t size, const char *filename, struct stat *source,
+		struct tz_data *data);
+static int tz_bundlefind(const char *path, const char *filename, struct stat *source,
+		struct tz_data *data);
+static void tz_bundlenote(const char *path, const char *filename, struct stat *source,
+		struct tz_data *data);
+static int tz_bundlewrite(const char *path);
+static int tz_writer_gc(lua_State *L);
+static int tz_dump(lua_State *L);
+static int tz_cachedir(lua_State *L);
+static int tz_cachewrite(lua_State *L);
+static int tz_zone_from_tzif(lua_State *L);
+static int tz_load_image(lua_State *L);
+static int tz_fixedfooter(char *footer, size_t size, struct tz_type *type, const char *abbr);
+static void tz_subset(lua_State *L, struct tz_data *data, int64_t from, int64_t to);
+static void tz_addbe(luaL_Buffer *b, uint64_t value, size_t size);
+static void tz_tzif(lua_State *L, struct tz_data *data);
+static void tz_exportdata(lua_State *L, const char *timezone, size_t len, int format,
+		int64_t from, int64_t to);
+static void tz_exportargs(lua_State *L, int index, int *format, int64_t *from, int64_t *to);
+static int tz_exportpath(const char *dir, const char *name, char *path, size_t size, int create);
+static int tz_exportlinks(lua_State *L, const char *dir, int n, int create);
+static int tz_export(lua_State *L);
+static int tz_exportdir(lua_State *L);
+
+static void tz_pin(void);
+static void *tz_job_run(void *arg);
+static void tz_job_free(struct tz_job *job);
+static struct tz_job *tz_job_acquire(const char *timezone, const char *filename,
+		const char *bundle);
+static void tz_job_release(struct tz_job *job);
+static int tz_loader_tostring(lua_State *L);
+static int tz_loader_gc(lua_State *L);
+static int tz_loader_adopt(lua_State *L, struct tz_loader *loader);
+static int tz_loader_fd(lua_State *L);
+static int tz_loader_ready(lua_State *L);
+static int tz_async(lua_State *L);
+#if LUA_VERSION_NUM >= 503
+static int tz_await_continue(lua_State *L, int status, lua_KContext ctx);
+static int tz_await(lua_State *L);
+#endif
+
+static int tz_schedule_tostring(lua_State *L);
+static int tz_schedule_gc(lua_State *L);
+static int tz_schedule_spans(lua_State *L, int index, int32_t *spans, int32_t base);
+static int tz_schedule_compare(const void *a, const void *b);
+static int tz_schedule_merge(int32_t *spans, int count);
+static void tz_schedule_window(struct tz_schedule *schedule, int64_t t);
+static int tz_schedule_isopen(lua_State *L);
+static int64_t tz_schedule_count(struct tz_schedule *schedule, int64_t x);
+static int64_t tz_schedule_local(struct tz_schedule *schedule, int64_t from, int64_t to);
+static int tz_schedule_duration(lua_State *L);
+static int tz_schedule_exceptioncompare(const void *a, const void *b);
+
+static int tz_timers_tostring(lua_State *L);
+static int tz_timers_gc(lua_State *L);
+static int tz_timers_len(lua_State *L);
+static inline int tz_timers_less(struct tz_timers *timers, int32_t a, int32_t b);
+static void tz_timers_up(struct tz_timers *timers, int pos);
+static void tz_timers_down(struct tz_timers *timers, int pos);
+static int64_t tz_timers_due(struct tz_timers *timers, struct tz_timer *timer);
+static int tz_timers_skip(struct tz_timers *timers, struct tz_timer *timer, int64_t now);
+static int tz_timers_add(lua_State *L);
+static int tz_timers_remove(lua_State *L);
+static int tz_timers_next(lua_State *L);
+static int tz_timers_pop_due(lua_State *L);
+static int tz_timers(lua_State *L);
+
+static int tz_beyond(int64_t a, int64_t b, double limit);
+static int tz_parseduration(const char *p, size_t len, struct tz_duration *duration);
+static int tz_parsedatetime(struct tz_data *data, const char *p, size_t len, int64_t *t);
+static int tz_parseinterval(struct tz_data *data, const char *p, size_t len,
+		struct tz_interval *interval);
+static int tz_addduration(struct tz_data *data, int64_t t, const struct tz_duration *duration,
+		int64_t k, int64_t *result);
+static int tz_occurrence(struct tz_data *data, struct tz_interval *interval, int64_t k,
+		int64_t *start, int64_t *end);
+static int tz_add(lua_State *L);
+static int tz_intervalfn(lua_State *L);
+static int tz_occurrences_next(lua_State *L);
+static int tz_occurrences(lua_State *L);
+
+static int tz_resolvetokens(const char *phrase, size_t len, char *buffer, struct tz_token *tokens);
+static int tz_resolveword(const struct tz_token *token, const char *word);
+static int tz_resolveweekday(const struct tz_token *token);
+static int tz_resolveunit(const struct tz_token *token);
+static int tz_resolvecount(const struct tz_token *token, int64_t *count);
+static int tz_resolvetime(const struct tz_token *tokens, int n, int *i, int at, int *secs);
+static int tz_resolve(lua_State *L);
+
+static int tz_leap(int64_t t, int gps);
+static int tz_fromscale(struct tz_data *data, int scale, double value, double *t);
+static int tz_toscale(struct tz_data *data, int scale, double t, double *value);
+static void tz_pushscale(lua_State *L, int scale, double value);
+static int tz_convert(lua_State *L);
 
 static int tz_info(lua_State *L);
+static int tz_infobatch(lua_State *L);
+static int tz_batchtimes(lua_State *L, const char **buffer);
+static void tz_batchgather(lua_State *L, const char *buffer, int64_t *t, int first, int n);
+static int tz_breakdownfn(lua_State *L);
+static int tz_isoformat(lua_State *L);
+static int tz_isoparse(lua_State *L);
+static int tz_strategyinfo(lua_State *L);
+static struct tz_period *tz_period(struct tz_data *data, int granularity, int64_t t);
+static struct tz_data *tz_periodargs(lua_State *L, int *granularity);
+static int tz_datekey(lua_State *L);
+static int tz_datepath(lua_State *L);
+static int tz_dateformat(lua_State *L, const char *format, struct tz_data *data,
+		struct tz_type *type, struct tz_fields *fields);
+static int tz_datemulti(lua_State *L);
 static int tz_date(lua_State *L);
 static int tz_time(lua_State *L);
+static int tz_diffone(struct tz_data *data, int unit, int64_t t1, int64_t t2, int64_t *result);
+static int tz_diff(lua_State *L);
+static int tz_delta(lua_State *L);
+static int tz_overlap(lua_State *L);
+static int tz_schedule(lua_State *L);
 
 
+static pthread_mutex_t  tz_mutex = PTHREAD_MUTEX_INITIALIZER;  /* guards process-wide state */
+static struct tz_job   *tz_jobs;                                /* pending and completed jobs */
+static int              tz_tracing;                             /* tracing states; atomic */
+static pthread_once_t   tz_simd_once = PTHREAD_ONCE_INIT;
+static pthread_once_t   tz_pin_once = PTHREAD_ONCE_INIT;
+static int              tz_pinned;                              /* module cannot be unloaded */
+static int              tz_simd;                                /* TZ_SIMD_* */
+static pthread_mutex_t  tz_bundle_mutex = PTHREAD_MUTEX_INITIALIZER;  /* guards bundles */
+static struct tz_bundle *tz_bundles;                            /* mapped cache bundles */
+
 static const int DAYS_PER_MONTH[2][12] = {
 	{ 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 },
 	{ 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 }
 };
 
+static const char DIGIT_PAIRS[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+
+static const int64_t LEAP_SECONDS[][2] = {  /* time, TAI minus UTC from that time */
+	{ 63072000, 10 },    /* 1972-01-01 */
+	{ 78796800, 11 },    /* 1972-07-01 */
+	{ 94694400, 12 },    /* 1973-01-01 */
+	{ 126230400, 13 },   /* 1974-01-01 */
+	{ 157766400, 14 },   /* 1975-01-01 */
+	{ 189302400, 15 },   /* 1976-01-01 */
+	{ 220924800, 16 },   /* 1977-01-01 */
+	{ 252460800, 17 },   /* 1978-01-01 */
+	{ 283996800, 18 },   /* 1979-01-01 */
+	{ 315532800, 19 },   /* 1980-01-01 */
+	{ 362793600, 20 },   /* 1981-07-01 */
+	{ 394329600, 21 },   /* 1982-07-01 */
+	{ 425865600, 22 },   /* 1983-07-01 */
+	{ 489024000, 23 },   /* 1985-07-01 */
+	{ 567993600, 24 },   /* 1988-01-01 */
+	{ 631152000, 25 },   /* 1990-01-01 */
+	{ 662688000, 26 },   /* 1991-01-01 */
+	{ 709948800, 27 },   /* 1992-07-01 */
+	{ 741484800, 28 },   /* 1993-07-01 */
+	{ 773020800, 29 },   /* 1994-07-01 */
+	{ 820454400, 30 },   /* 1996-01-01 */
+	{ 867715200, 31 },   /* 1997-07-01 */
+	{ 915148800, 32 },   /* 1999-01-01 */
+	{ 1136073600, 33 },  /* 2006-01-01 */
+	{ 1230768000, 34 },  /* 2009-01-01 */
+	{ 1341100800, 35 },  /* 2012-07-01 */
+	{ 1435708800, 36 },  /* 2015-07-01 */
+	{ 1483228800, 37 }   /* 2017-01-01 */
+};
+#define LEAP_COUNT (sizeof(LEAP_SECONDS) / sizeof(LEAP_SECONDS[0]))
+
 
 /*
  * utilities
@@ -113,15 +593,147 @@ static int getfield (lua_State *L, int index, const char *key, int d) {
 	return value;
 }
 
+static int getindex (lua_State *L, int index, int n) {
+	int  value;
+#if LUA_VERSION_NUM >= 503
+	int  isint;
+#endif
+
+	lua_rawgeti(L, index, n);
+	if (lua_type(L, -1) != LUA_TNUMBER) {
+		return luaL_error(L, "element %d has wrong type (number expected, got %s)",
+				n, luaL_typename(L, -1));
+	}
+#if LUA_VERSION_NUM >= 503
+	value = lua_tointegerx(L, -1, &isint);
+	if (!isint) {
+		return luaL_error(L, "element %d is not an integer", n);
+	}
+#else
+	value = lua_tointeger(L, -1);
+#endif
+	lua_pop(L, 1);
+	return value;
+}
+
+static int64_t gettime (lua_State *L, int index, int n) {
+	int64_t  t;
+#if LUA_VERSION_NUM >= 503
+	int      isint;
+#endif
+
+	lua_rawgeti(L, index, n);
+	if (lua_type(L, -1) != LUA_TNUMBER) {
+		return luaL_error(L, "element %d has wrong type (number expected, got %s)",
+				n, luaL_typename(L, -1));
+	}
+#if LUA_VERSION_NUM >= 503
+	t = (int64_t)lua_tointegerx(L, -1, &isint);
+	if (!isint) {
+		return luaL_error(L, "element %d is not an integer", n);
+	}
+#else
+	t = (int64_t)lua_tonumber(L, -1);
+#endif
+	lua_pop(L, 1);
+	return t;
+}
+
 static inline void setfield (lua_State *L, const char *key, int value) {
 	lua_pushinteger(L, value);
 	lua_setfield(L, -2, key);
 }
 
+static inline int64_t checktime (lua_State *L, int index) {
+#if LUA_VERSION_NUM >= 503
+	return (int64_t)luaL_checkinteger(L, index);
+#else
+	return (int64_t)luaL_checknumber(L, index);
+#endif
+}
+
+static inline int64_t opttime (lua_State *L, int index) {
+	return lua_isnoneornil(L, index) ? (int64_t)time(NULL) : checktime(L, index);
+}
+
+static inline void pushtime (lua_State *L, int64_t t) {
+#if LUA_VERSION_NUM >= 503
+	lua_pushinteger(L, (lua_Integer)t);
+#else
+	lua_pushnumber(L, (lua_Number)t);
+#endif
+}
+
+static void pushinterval (lua_State *L, int64_t open, int64_t close) {
+	lua_createtable(L, 2, 0);
+	pushtime(L, open);
+	lua_rawseti(L, -2, 1);
+	pushtime(L, close);
+	lua_rawseti(L, -2, 2);
+}
+
 static inline int days (int year, int month) {
 	return DAYS_PER_MONTH[year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)][month - 1];
 }
 
+static inline int64_t epochday (int year, int month, int day) {
+	/* source: Henry F. Fliegel, Thomas C. van Flandern:
+	   Letters to the editor: a machine algorithm for processing
+	   calendar dates. Commun. ACM 11(10): 657 (1968) */
+	return (1461 * (year + 4800 + (month - 14) / 12)) / 4
+			+ (367 * (month - 2 - 12 * ((month - 14) / 12))) / 12
+			- (3 * ((year + 4900 + (month - 14) / 12) / 100)) / 4
+			+ day - 32075     /* Julian day */
+			- TZ_EPOCH;       /* epoch */
+}
+
+static inline int64_t floordiv (int64_t a, int64_t b) {
+	return a / b - (a % b < 0);
+}
+
+static inline int isotime (int year, int month, int day, int hour, int min, int sec, int64_t *t) {
+	if (month < 1 || month > 12 || day < 1 || day > days(year, month) || hour > 23 || min > 59
+			|| sec > 59) {
+		return 0;
+	}
+	*t = epochday(year, month, day) * (int64_t)86400 + hour * 3600 + min * 60 + sec;
+	return 1;
+}
+
+static int isooffset (const char *p, size_t len, int32_t *off) {
+	int  hour, min;
+
+	if (len == 1 && p[0] == 'Z') {
+		*off = 0;
+		return 1;
+	}
+	if (len != 6 || (p[0] != '+' && p[0] != '-') || p[3] != ':' || !isdigit((unsigned char)p[1])
+			|| !isdigit((unsigned char)p[2]) || !isdigit((unsigned char)p[4])
+			|| !isdigit((unsigned char)p[5])) {
+		return 0;
+	}
+	hour = (p[1] - '0') * 10 + p[2] - '0';
+	min = (p[4] - '0') * 10 + p[5] - '0';
+	if (hour > 23 || min > 59) {
+		return 0;
+	}
+	*off = (hour * 3600 + min * 60) * (p[0] == '-' ? -1 : 1);
+	return 1;
+}
+
+static int isodigits (const char *p, int n) {
+	int  i, value;
+
+	value = 0;
+	for (i = 0; i < n; i++) {
+		if (!isdigit((unsigned char)p[i])) {
+			return -1;
+		}
+		value = value * 10 + p[i] - '0';
+	}
+	return value;
+}
+
 #if LUA_VERSION_NUM < 502
 void *luaL_testudata (lua_State *L, int index, const char *name) {
 	void  *userdata;
@@ -156,10 +768,9 @@ static int tz_gc (lua_State *L) {
 	struct tz_data  *data;
 
 	data = luaL_checkudata(L, 1, TZ_DATA);
-	free(data->timevalues);
-	free(data->timetypes);
-	free(data->types);
-	free(data->chars);
+	if (!data->mapped) {
+		free(data->block);
+	}
 	return 0;
 }
 
@@ -168,19 +779,19 @@ static int tz_gc (lua_State *L) {
  * zoneinfo
  */
 
-static void tz_readheader (lua_State *L, FILE *f, off_t size, struct tz_header *header) {
+static const char *tz_parseheader (const char **p, const char *end, struct tz_header *header) {
 	/* read and check header */
-	if (fread(header, sizeof(struct tz_header), 1, f) != 1) {
-		fclose(f);
-		luaL_error(L, "cannot read TZ file header");
+	if ((size_t)(end - *p) < sizeof(struct tz_header)) {
+		return "cannot read TZ file header";
 	}
+	memcpy(header, *p, sizeof(struct tz_header));
+	*p += sizeof(struct tz_header);
+	header->footercnt = 0;
 	if (strncmp(header->magic, "TZif", 4) != 0) {
-		fclose(f);
-		luaL_error(L, "TZ file magic mismatch");
+		return "TZ file magic mismatch";
 	}
 	if (header->version != '\0' && header->version != '2' && header->version != '3') {
-		fclose(f);
-		luaL_error(L, "unsupported TZ file version");
+		return "unsupported TZ file version";
 	}
 
 	/* convert */
@@ -192,110 +803,216 @@ static void tz_readheader (lua_State *L, FILE *f, off_t size, struct tz_header *
 	header->charcnt = be32toh(header->charcnt);
 
 	/* sanity checks */
-	if ((size_t)header->timecnt > size / sizeof(uint8_t)
-			|| (size_t)header->typecnt > size / TZ_TYPE_PACKED
-			|| (size_t)header->charcnt > size / sizeof(char)
-			|| header->typecnt == 0) {
-		fclose(f);
-		luaL_error(L, "malformed TZ file");
+	return tz_checkheader(header);
+}
+
+static const char *tz_checkheader (struct tz_header *header) {
+	if (header->isstdcnt < 0 || header->isgmtcnt < 0 || header->leapcnt < 0
+			|| header->timecnt < 0 || header->typecnt <= 0 || header->typecnt > 256
+			|| header->charcnt < 0 || header->footercnt < 0) {
+		return "malformed TZ file";
 	}
+	return NULL;
 }
 
-static void tz_read (lua_State *L, const char *filename, off_t size) {
-	int               i, read64;
-	char             *type;
-	FILE             *f;
-	int32_t          *timevalue32;
-	struct tz_data   *data;
-	struct tz_header *header;
+static const char *tz_check (struct tz_data *data) {
+	int  i;
 
-	/* allocate userdata */
-	data = lua_newuserdata(L, sizeof(struct tz_data));
-	memset(data, 0, sizeof(struct tz_data));
-	luaL_getmetatable(L, TZ_DATA);
-	lua_setmetatable(L, -2);
-	header = &data->header;
+	for (i = 0; i < data->header.timecnt; i++) {
+		if (data->timetypes[i] >= data->header.typecnt) {
+			return "malformed TZ file";
+		}
+	}
+	for (i = 0; i < data->header.typecnt; i++) {
+		if (data->types[i].abbrind > data->header.charcnt) {
+			return "malformed TZ file";
+		}
+	}
+	data->chars[data->header.charcnt] = '\0';
+	data->footer[data->header.footercnt] = '\0';
+	tz_strategy(data);
+	return NULL;
+}
+
+static size_t tz_blocksize (struct tz_header *header) {
+	return header->timecnt * sizeof(int64_t)
+			+ header->typecnt * sizeof(struct tz_type)
+			+ header->timecnt * sizeof(uint8_t)
+			+ header->charcnt * sizeof(char) + 1  /* terminator */
+			+ header->footercnt * sizeof(char) + 1;
+}
+
+static void tz_layout (struct tz_data *data, void *block) {
+	data->block = block;
+	data->timevalues = block;
+	data->types = (struct tz_type *)(data->timevalues + data->header.timecnt);
+	data->timetypes = (uint8_t *)(data->types + data->header.typecnt);
+	data->chars = (char *)(data->timetypes + data->header.timecnt);
+	data->footer = data->chars + data->header.charcnt + 1;
+}
+
+static const char *tz_parse (const char *buffer, size_t size, struct tz_data *data) {
+	int                i, read64;
+	size_t             skip;
+	uint32_t           value32;
+	uint64_t           value64;
+	const char        *p, *end, *error, *footer, *eol;
+	struct tz_header  *header;
 
 	/* read and process header */
-	f = fopen(filename, "r");
-	if (!f) {
-		luaL_error(L, "cannot open TZ file '%s'", filename);
+	p = buffer;
+	end = buffer + size;
+	header = &data->header;
+	if ((error = tz_parseheader(&p, end, header))) {
+		return error;
 	}
-	tz_readheader(L, f, size, header);
 
 	/* use 64-bit structure? */
 	read64 = header->version >= '2';
 	if (read64) {
-		if (fseek(f, header->timecnt * (sizeof(int32_t) + sizeof(uint8_t))
+		skip = header->timecnt * (sizeof(int32_t) + sizeof(uint8_t))
 				+ header->typecnt * TZ_TYPE_PACKED
 				+ header->charcnt * sizeof(char)
 				+ header->leapcnt * (sizeof(int32_t) + sizeof(int32_t))
 				+ header->isstdcnt * sizeof(uint8_t)
-				+ header->isgmtcnt * sizeof(uint8_t), SEEK_CUR) != 0) {
-			fclose(f);
-			luaL_error(L, "cannot read TZ file");
+				+ header->isgmtcnt * sizeof(uint8_t);
+		if (skip > (size_t)(end - p)) {
+			return "cannot read TZ file";
+		}
+		p += skip;
+		if ((error = tz_parseheader(&p, end, header))) {
+			return error;
+		}
+	}
+	if (header->timecnt * ((read64 ? sizeof(int64_t) : sizeof(int32_t)) + sizeof(uint8_t))
+			+ header->typecnt * TZ_TYPE_PACKED
+			+ header->charcnt * sizeof(char) > (size_t)(end - p)) {
+		return "cannot read TZ data";
+	}
+
+	/* the footer of version 2 files follows the data, enclosed in newlines */
+	footer = NULL;
+	if (read64) {
+		skip = header->timecnt * (sizeof(int64_t) + sizeof(uint8_t))
+				+ header->typecnt * TZ_TYPE_PACKED
+				+ header->charcnt * sizeof(char)
+				+ header->leapcnt * (sizeof(int64_t) + sizeof(int32_t))
+				+ header->isstdcnt * sizeof(uint8_t)
+				+ header->isgmtcnt * sizeof(uint8_t);
+		if (skip < (size_t)(end - p) && p[skip] == '\n'
+				&& (eol = memchr(p + skip + 1, '\n', end - p - skip - 1))) {
+			footer = p + skip + 1;
+			header->footercnt = eol - footer;
 		}
-		tz_readheader(L, f, size, header);
 	}
 
 	/* allocate */
-	data->timevalues = calloc(header->timecnt, sizeof(int64_t));
-	data->timetypes = calloc(header->timecnt, sizeof(uint8_t));
-	data->types = calloc(header->typecnt, sizeof(struct tz_type));
-	data->chars = calloc(header->charcnt, sizeof(char));
-	if (!(data->timevalues && data->timetypes && data->types && data->chars)) {
-		fclose(f);
-		luaL_error(L, "cannot allocate TZ data");
+	tz_layout(data, calloc(1, tz_blocksize(header)));
+	if (!data->block) {
+		return "cannot allocate TZ data";
 	}
 
 	/* read */
-	if ((read64 && fread(data->timevalues, sizeof(int64_t),
-			header->timecnt, f) != (size_t)header->timecnt)
-			|| (!read64 && fread(data->timevalues, sizeof(int32_t),
-			header->timecnt, f) != (size_t)header->timecnt)
-			|| fread(data->timetypes, sizeof(uint8_t),
-			header->timecnt, f) != (size_t)header->timecnt
-			|| fread(data->types, TZ_TYPE_PACKED,
-			header->typecnt, f) != (size_t)header->typecnt
-			|| fread(data->chars, sizeof(char),
-			header->charcnt, f) != (size_t)header->charcnt) {
-		fclose(f);
-		luaL_error(L, "cannot read TZ data");
+	for (i = 0; i < header->timecnt; i++) {
+		if (read64) {
+			memcpy(&value64, p, sizeof(value64));
+			data->timevalues[i] = (int64_t)be64toh(value64);
+			p += sizeof(value64);
+		} else {
+			memcpy(&value32, p, sizeof(value32));
+			data->timevalues[i] = (int32_t)be32toh(value32);
+			p += sizeof(value32);
+		}
+	}
+	memcpy(data->timetypes, p, header->timecnt);
+	p += header->timecnt;
+	for (i = 0; i < header->typecnt; i++) {
+		memcpy(&value32, p, sizeof(value32));
+		data->types[i].gmtoff = (int32_t)be32toh(value32);
+		data->types[i].isdst = !!p[4];
+		data->types[i].abbrind = (uint8_t)p[5];
+		p += TZ_TYPE_PACKED;
+	}
+	memcpy(data->chars, p, header->charcnt);
+	if (footer) {
+		memcpy(data->footer, footer, header->footercnt);
 	}
-	fclose(f);
 
-	/* process */
-	if (read64) {
-		for (i = 0; i < header->timecnt; i++) {
-			data->timevalues[i] = be64toh(data->timevalues[i]);
-		}
-	} else {
-		timevalue32 = ((int32_t *)data->timevalues) + header->timecnt;
-		for (i = header->timecnt - 1; i >= 0; i--) {
-			data->timevalues[i] = be32toh(*--timevalue32);
-		}
+	/* check */
+	return tz_check(data);
+}
+
+static int tz_loadfile (const char *filename, struct tz_data *data, char *error, size_t size,
+		off_t *bytes) {
+	char         *buffer;
+	FILE         *f;
+	const char   *message;
+	struct stat   buf;
+
+	/* read file */
+	f = fopen(filename, "r");
+	if (!f) {
+		snprintf(error, size, "cannot open TZ file '%s'", filename);
+		return -1;
 	}
-	for (i = 0; i < data->header.timecnt; i++) {
-		if (data->timetypes[i] >= header->typecnt) {
-			luaL_error(L, "malformed TZ file");
-		}
+	if (fstat(fileno(f), &buf) != 0 || !S_ISREG(buf.st_mode)) {
+		fclose(f);
+		snprintf(error, size, "cannot read TZ file");
+		return -1;
+	}
+	buffer = malloc(buf.st_size + 1);
+	if (!buffer) {
+		fclose(f);
+		snprintf(error, size, "cannot allocate TZ data");
+		return -1;
 	}
-	type = (char *)data->types + header->typecnt * TZ_TYPE_PACKED;
-	for (i = header->typecnt - 1; i >= 0; i--) {
-		type -= TZ_TYPE_PACKED;
-		memmove(&data->types[i], type, TZ_TYPE_PACKED);
-		data->types[i].gmtoff = be32toh(data->types[i].gmtoff);
-		data->types[i].isdst = !!data->types[i].isdst;
+	if (fread(buffer, 1, buf.st_size, f) != (size_t)buf.st_size) {
+		free(buffer);
+		fclose(f);
+		snprintf(error, size, "cannot read TZ file");
+		return -1;
+	}
+	fclose(f);
+	*bytes = buf.st_size;
+
+	/* parse */
+	message = tz_parse(buffer, buf.st_size, data);
+	free(buffer);
+	if (message) {
+		snprintf(error, size, "%s", message);
+		return -1;
 	}
+	return 0;
 }
 
-static struct tz_data *tz_data (lua_State *L, const char *timezone, size_t len) {
-	size_t           i;
-	char             filename[128];
-	struct stat      buf;
+static int tz_load (const char *filename, struct tz_data *data, char *error, size_t size) {
+	int    status;
+	off_t  bytes;
+
+	bytes = 0;
+	TZ_PROBE1(read__start, filename);
+	status = tz_loadfile(filename, data, error, size, &bytes);
+	TZ_PROBE3(read__end, filename, (long)bytes, status);
+	return status;
+}
+
+static void tz_read (lua_State *L, const char *filename) {
+	char             error[256];
 	struct tz_data  *data;
 
-	/* get from TZ table */
+	/* allocate userdata */
+	data = lua_newuserdata(L, sizeof(struct tz_data));
+	memset(data, 0, sizeof(struct tz_data));
+	luaL_getmetatable(L, TZ_DATA);
+	lua_setmetatable(L, -2);
+
+	/* load */
+	if (tz_load(filename, data, error, sizeof(error)) != 0) {
+		luaL_error(L, "%s", error);
+	}
+}
+
+static void tz_cache (lua_State *L) {
 	lua_getfield(L, LUA_REGISTRYINDEX, TZ_CACHE);
 	if (lua_type(L, -1) != LUA_TTABLE) {
 		lua_pop(L, 1);
@@ -303,13 +1020,10 @@ static struct tz_data *tz_data (lua_State *L, const char *timezone, size_t len)
 		lua_pushvalue(L, -1);
 		lua_setfield(L, LUA_REGISTRYINDEX, TZ_CACHE);
 	}
-	lua_getfield(L, -1, timezone);
-	data = luaL_testudata(L, -1, TZ_DATA);
-	if (data) {
-		lua_remove(L, -2);
-		return data;
-	}
-	lua_pop(L, 1);
+}
+
+static void tz_filename (lua_State *L, const char *timezone, size_t len, char *filename) {
+	size_t  i;
 
 	/* local time or generic? */
 	if (len == sizeof(TZ_LOCALTIME) - 1 && memcmp(timezone, TZ_LOCALTIME, len) == 0) {
@@ -317,7 +1031,7 @@ static struct tz_data *tz_data (lua_State *L, const char *timezone, size_t len)
 		memcpy(filename, TZ_LOCALFILE, sizeof(TZ_LOCALFILE));
 	} else {
 		/* check timezone length */
-		if (len > sizeof(filename) - sizeof(TZ_ZONEINFO)) {
+		if (len > TZ_FILENAME_MAX - sizeof(TZ_ZONEINFO)) {
 			luaL_error(L, "timezone too long");
 		}
 
@@ -333,14 +1047,45 @@ static struct tz_data *tz_data (lua_State *L, const char *timezone, size_t len)
 		memcpy(filename, TZ_ZONEINFO, sizeof(TZ_ZONEINFO) - 1);
 		memcpy(filename + sizeof(TZ_ZONEINFO) - 1, timezone, len + 1);
 	}
+}
+
+static struct tz_data *tz_data (lua_State *L, const char *timezone, size_t len) {
+	char             filename[TZ_FILENAME_MAX], path[PATH_MAX];
+	struct stat      buf;
+	struct tz_data  *data;
+
+	/* get from TZ table */
+	tz_cache(L);
+	lua_getfield(L, -1, timezone);
+	data = luaL_testudata(L, -1, TZ_DATA);
+	if (data) {
+		TZ_PROBE1(data__hit, timezone);
+		lua_remove(L, -2);
+		return data;
+	}
+	lua_pop(L, 1);
+	TZ_PROBE1(data__miss, timezone);
 
 	/* check file */
+	tz_filename(L, timezone, len, filename);
 	if (stat(filename, &buf) != 0 || !S_ISREG(buf.st_mode)) {
 		luaL_error(L, "unknown timezone '%s'", timezone);
 	}
 
-	/* read */
-	tz_read(L, filename, buf.st_size);
+	/* read, preferring the cache bundle */
+	if (tz_bundlepath(L, path, sizeof(path))) {
+		data = lua_newuserdata(L, sizeof(struct tz_data));
+		memset(data, 0, sizeof(struct tz_data));
+		luaL_getmetatable(L, TZ_DATA);
+		lua_setmetatable(L, -2);
+		if (!tz_bundlefind(path, filename, &buf, data)) {
+			lua_pop(L, 1);
+			tz_read(L, filename);
+			tz_bundlenote(path, filename, &buf, lua_touserdata(L, -1));
+		}
+	} else {
+		tz_read(L, filename);
+	}
 
 	/* cache */
 	lua_pushvalue(L, -1);
@@ -351,29 +1096,162 @@ static struct tz_data *tz_data (lua_State *L, const char *timezone, size_t len)
 	return lua_touserdata(L, -1);
 }
 
-static struct tz_type *tz_find (struct tz_data *data, int64_t t, int isdst, int reverse) {
-	int  lower, upper, mid;
+static void tz_strategy (struct tz_data *data) {
+	int      b, i, timecnt;
+	int64_t  span;
 
-	lower = 0;
-	upper = data->header.timecnt - 1;
-	if (!reverse) {
-		while (lower <= upper) {
-			mid = (lower + upper) / 2;
-			if (data->timevalues[mid] <= t) {
-				lower = mid + 1;
-			} else {
-				upper = mid - 1;
-			}
-		}
+	/* clear cached periods */
+	memset(data->periods, 0, sizeof(data->periods));
+
+	/* choose by number of transitions */
+	timecnt = data->header.timecnt;
+	if (timecnt == 0) {
+		data->strategy = TZ_STRATEGY_CONST;
+	} else if (timecnt <= TZ_LINEAR_MAX) {
+		data->strategy = TZ_STRATEGY_LINEAR;
 	} else {
-		while (lower <= upper) {
-			mid = (lower + upper) / 2;
+		data->strategy = TZ_STRATEGY_BUCKET;
+	}
+	if (data->strategy != TZ_STRATEGY_BUCKET) {
+		return;
+	}
+
+	/* build bucket index: buckets[b] is the first transition at or after bucket b */
+	data->base = data->timevalues[0];
+	span = data->timevalues[timecnt - 1] - data->base;
+	data->shift = 0;
+	while ((span >> data->shift) >= TZ_BUCKETS) {
+		data->shift++;
+	}
+	i = 0;
+	for (b = 0; b <= TZ_BUCKETS; b++) {
+		while (i < timecnt && data->timevalues[i] < data->base
+				+ ((int64_t)b << data->shift)) {
+			i++;
+		}
+		data->buckets[b] = i;
+	}
+}
+
+static int tz_index (struct tz_data *data, int64_t t) {
+	int  lower, upper, mid, depth, b;
+
+	switch (data->strategy) {
+	case TZ_STRATEGY_CONST:
+		TZ_PROBE3(find, 0, 0, 0);
+		return -1;
+
+	case TZ_STRATEGY_LINEAR:
+		upper = data->header.timecnt - 1;
+		depth = 1;
+		while (upper >= 0 && data->timevalues[upper] > t) {
+			upper--;
+			depth++;
+		}
+		TZ_PROBE3(find, data->header.timecnt, depth, 0);
+		return upper;
+
+	default:
+		if (t < data->base) {
+			TZ_PROBE3(find, data->header.timecnt, 0, 0);
+			return -1;
+		}
+		if (t >= data->timevalues[data->header.timecnt - 1]) {
+			TZ_PROBE3(find, data->header.timecnt, 0, 0);
+			return data->header.timecnt - 1;
+		}
+		b = (t - data->base) >> data->shift;
+		lower = data->buckets[b];
+		upper = data->buckets[b + 1] - 1;
+	}
+	depth = 0;
+	while (lower <= upper) {
+		mid = (lower + upper) / 2;
+		if (data->timevalues[mid] <= t) {
+			lower = mid + 1;
+		} else {
+			upper = mid - 1;
+		}
+		depth++;
+	}
+	TZ_PROBE3(find, data->header.timecnt, depth, 0);
+	return upper;
+}
+
+static void tz_indexbatch (struct tz_data *data, const int64_t *t, int32_t *index, int n) {
+	int             i, j, k, b, half, maxlen, timecnt;
+	int             lo[TZ_GROUP], len[TZ_GROUP];
+	const int64_t  *timevalues;
+
+	/* only the bucket strategy searches */
+	if (data->strategy != TZ_STRATEGY_BUCKET) {
+		for (i = 0; i < n; i++) {
+			index[i] = tz_index(data, t[i]);
+		}
+		return;
+	}
+
+	/* search groups in lockstep, prefetching the next probe of each search */
+	timecnt = data->header.timecnt;
+	timevalues = data->timevalues;
+	for (i = 0; i < n; i += TZ_GROUP) {
+		k = n - i < TZ_GROUP ? n - i : TZ_GROUP;
+		maxlen = 1;
+		for (j = 0; j < k; j++) {
+			if (t[i + j] < data->base) {
+				lo[j] = 0;  /* fails the final check */
+				len[j] = 1;
+			} else if (t[i + j] >= timevalues[timecnt - 1]) {
+				lo[j] = timecnt - 1;
+				len[j] = 1;
+			} else {
+				b = (t[i + j] - data->base) >> data->shift;
+				lo[j] = data->buckets[b];
+				len[j] = data->buckets[b + 1] - lo[j];
+				if (len[j] == 0) {
+					lo[j]--;  /* empty bucket; the preceding transition applies */
+					len[j] = 1;
+				}
+				if (len[j] > maxlen) {
+					maxlen = len[j];
+				}
+			}
+			TZ_PREFETCH(&timevalues[lo[j] + (len[j] >> 1)]);
+		}
+		while (maxlen > 1) {
+			for (j = 0; j < k; j++) {
+				half = len[j] >> 1;
+				lo[j] += timevalues[lo[j] + half] <= t[i + j] ? half : 0;
+				len[j] -= half;
+				TZ_PREFETCH(&timevalues[lo[j] + (len[j] >> 1)]);
+			}
+			maxlen -= maxlen >> 1;
+		}
+		for (j = 0; j < k; j++) {
+			index[i + j] = timevalues[lo[j]] <= t[i + j] ? lo[j] : lo[j] - 1;
+		}
+	}
+}
+
+static struct tz_type *tz_find (struct tz_data *data, int64_t t, int isdst, int reverse) {
+	int  lower, upper, mid, depth;
+
+	if (!reverse) {
+		upper = tz_index(data, t);
+	} else {
+		lower = 0;
+		upper = data->header.timecnt - 1;
+		depth = 0;
+		while (lower <= upper) {
+			mid = (lower + upper) / 2;
 			if (data->timevalues[mid] <= t - data->types[data->timetypes[mid]].gmtoff) {
 				lower = mid + 1;
 			} else {
 				upper = mid - 1;
 			}
+			depth++;
 		}
+		TZ_PROBE3(find, data->header.timecnt, depth, 1);
 		if (isdst >= 0  /* isdst is specified */
 				&& data->types[data->timetypes[upper]].isdst != isdst  /* not eq */
 				&& upper > 0  /* predecessor exists */
@@ -388,11 +1266,406 @@ static struct tz_type *tz_find (struct tz_data *data, int64_t t, int isdst, int
 	return upper >= 0 ? &data->types[data->timetypes[upper]] : &data->types[0];
 }
 
+static void tz_breakdown (int64_t t, struct tz_fields *fields) {
+	int  jd, l, n, i, j, sec;
+
+	/* time of day */
+	sec = t % 86400;
+	if (sec < 0) {
+		sec += 86400;
+	}
+	fields->hour = sec / 3600;
+	sec %= 3600;
+	fields->min = sec / 60;
+	fields->sec = sec % 60;
+
+	/* source: Henry F. Fliegel, Thomas C. van Flandern:
+	   Letters to the editor: a machine algorithm for processing
+	   calendar dates. Commun. ACM 11(10): 657 (1968) */
+	if (t < 0) {
+		t -= 86399;
+	}
+	jd = t / 86400 + TZ_EPOCH;  /* Julian day */
+	l = jd + 68569;
+	n = (4 * l) / 146097;
+	l = l - (146097 * n + 3) / 4;
+	i = (4000 * (l + 1)) / 1461001;
+	l = l - (1461 * i) / 4 + 31;
+	j = (80 * l) / 2447;
+	fields->day = l - (2447 * j) / 80;
+	l = j / 11;
+	fields->month = j + 2 - (12 * l);
+	fields->year = 100 * (n - 49) + i + l;
+	fields->wday = (jd + 1) % 7 + 1;
+	fields->yday = 0;
+	for (i = 1; i < fields->month; i++) {
+		fields->yday += days(fields->year, i);
+	}
+	fields->yday += fields->day;
+}
+
+
+/*
+ * batch kernels
+ */
+
+static void tz_simdinit (void) {
+#if TZ_SIMD
+	__builtin_cpu_init();
+	tz_simd = __builtin_cpu_supports("avx2") ? TZ_SIMD_AVX2 : TZ_SIMD_NONE;
+#else
+	tz_simd = TZ_SIMD_NONE;
+#endif
+}
+
+static void tz_breakdown_scalar (const int64_t *t, struct tz_fields *fields, int n) {
+	int  i;
+
+	for (i = 0; i < n; i++) {
+		if (t[i] >= TZ_J0_TIME) {
+			tz_breakdown(t[i], &fields[i]);
+		} else {
+			memset(&fields[i], 0, sizeof(struct tz_fields));
+		}
+	}
+}
+
+#if TZ_SIMD
+/* Times in [TZ_J0_TIME, TZ_SIMD_MAX) are converted to doubles, where quotients by the
+   constants of the Fliegel-van Flandern algorithm are correctly rounded and thus floor exactly. */
+__attribute__((target("avx2")))
+static void tz_breakdown_avx2 (const int64_t *t, struct tz_fields *fields, int n) {
+	int       i, k;
+	int32_t   out[8][4];
+	__m256i   vt, inrange;
+	__m256d   magic, x, day, sec, hour, min, jd, l, nn, ii, j, mday, month, year, wday, yday;
+	__m256d   leap, adjust;
+
+	magic = _mm256_set1_pd(0x1.8p52);
+	for (i = 0; i + 4 <= n; i += 4) {
+		/* check range; convert via the magic number, exact for |t| < 2^51 */
+		vt = _mm256_loadu_si256((const __m256i *)&t[i]);
+		inrange = _mm256_and_si256(_mm256_cmpgt_epi64(vt, _mm256_set1_epi64x(TZ_J0_TIME - 1)),
+				_mm256_cmpgt_epi64(_mm256_set1_epi64x(TZ_SIMD_MAX), vt));
+		if (_mm256_movemask_epi8(inrange) != -1) {
+			tz_breakdown_scalar(&t[i], &fields[i], 4);
+			continue;
+		}
+		x = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(vt, _mm256_castpd_si256(magic))),
+				magic);
+
+		/* time of day */
+		day = _mm256_floor_pd(_mm256_div_pd(x, _mm256_set1_pd(86400)));
+		sec = _mm256_sub_pd(x, _mm256_mul_pd(day, _mm256_set1_pd(86400)));
+		hour = _mm256_floor_pd(_mm256_div_pd(sec, _mm256_set1_pd(3600)));
+		sec = _mm256_sub_pd(sec, _mm256_mul_pd(hour, _mm256_set1_pd(3600)));
+		min = _mm256_floor_pd(_mm256_div_pd(sec, _mm256_set1_pd(60)));
+		sec = _mm256_sub_pd(sec, _mm256_mul_pd(min, _mm256_set1_pd(60)));
+
+		/* date, as in tz_breakdown */
+		jd = _mm256_add_pd(day, _mm256_set1_pd(TZ_EPOCH));
+		l = _mm256_add_pd(jd, _mm256_set1_pd(68569));
+		nn = _mm256_floor_pd(_mm256_div_pd(_mm256_mul_pd(l, _mm256_set1_pd(4)),
+				_mm256_set1_pd(146097)));
+		l = _mm256_sub_pd(l, _mm256_floor_pd(_mm256_div_pd(_mm256_add_pd(_mm256_mul_pd(nn,
+				_mm256_set1_pd(146097)), _mm256_set1_pd(3)), _mm256_set1_pd(4))));
+		ii = _mm256_floor_pd(_mm256_div_pd(_mm256_mul_pd(_mm256_add_pd(l, _mm256_set1_pd(1)),
+				_mm256_set1_pd(4000)), _mm256_set1_pd(1461001)));
+		l = _mm256_add_pd(_mm256_sub_pd(l, _mm256_floor_pd(_mm256_div_pd(_mm256_mul_pd(ii,
+				_mm256_set1_pd(1461)), _mm256_set1_pd(4)))), _mm256_set1_pd(31));
+		j = _mm256_floor_pd(_mm256_div_pd(_mm256_mul_pd(l, _mm256_set1_pd(80)),
+				_mm256_set1_pd(2447)));
+		mday = _mm256_sub_pd(l, _mm256_floor_pd(_mm256_div_pd(_mm256_mul_pd(j,
+				_mm256_set1_pd(2447)), _mm256_set1_pd(80))));
+		l = _mm256_floor_pd(_mm256_div_pd(j, _mm256_set1_pd(11)));
+		month = _mm256_sub_pd(_mm256_add_pd(j, _mm256_set1_pd(2)),
+				_mm256_mul_pd(l, _mm256_set1_pd(12)));
+		year = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(nn,
+				_mm256_set1_pd(49)), _mm256_set1_pd(100)), ii), l);
+
+		/* weekday, and day of year from the days preceding the month */
+		x = _mm256_add_pd(jd, _mm256_set1_pd(1));
+		wday = _mm256_add_pd(_mm256_sub_pd(x, _mm256_mul_pd(_mm256_floor_pd(_mm256_div_pd(x,
+				_mm256_set1_pd(7))), _mm256_set1_pd(7))), _mm256_set1_pd(1));
+		leap = _mm256_and_pd(_mm256_cmp_pd(_mm256_floor_pd(_mm256_div_pd(year,
+				_mm256_set1_pd(4))), _mm256_div_pd(year, _mm256_set1_pd(4)), _CMP_EQ_OQ),
+				_mm256_or_pd(_mm256_cmp_pd(_mm256_floor_pd(_mm256_div_pd(year,
+				_mm256_set1_pd(100))), _mm256_div_pd(year, _mm256_set1_pd(100)), _CMP_NEQ_OQ),
+				_mm256_cmp_pd(_mm256_floor_pd(_mm256_div_pd(year, _mm256_set1_pd(400))),
+				_mm256_div_pd(year, _mm256_set1_pd(400)), _CMP_EQ_OQ)));
+		adjust = _mm256_and_pd(_mm256_cmp_pd(month, _mm256_set1_pd(2), _CMP_GT_OQ),
+				_mm256_blendv_pd(_mm256_set1_pd(-2), _mm256_set1_pd(-1), leap));
+		yday = _mm256_add_pd(_mm256_add_pd(_mm256_floor_pd(_mm256_div_pd(_mm256_sub_pd(
+				_mm256_mul_pd(month, _mm256_set1_pd(367)), _mm256_set1_pd(362)),
+				_mm256_set1_pd(12))), adjust), mday);
+
+		/* store */
+		_mm_storeu_si128((__m128i *)out[0], _mm256_cvtpd_epi32(sec));
+		_mm_storeu_si128((__m128i *)out[1], _mm256_cvtpd_epi32(min));
+		_mm_storeu_si128((__m128i *)out[2], _mm256_cvtpd_epi32(hour));
+		_mm_storeu_si128((__m128i *)out[3], _mm256_cvtpd_epi32(mday));
+		_mm_storeu_si128((__m128i *)out[4], _mm256_cvtpd_epi32(month));
+		_mm_storeu_si128((__m128i *)out[5], _mm256_cvtpd_epi32(year));
+		_mm_storeu_si128((__m128i *)out[6], _mm256_cvtpd_epi32(wday));
+		_mm_storeu_si128((__m128i *)out[7], _mm256_cvtpd_epi32(yday));
+		for (k = 0; k < 4; k++) {
+			fields[i + k].sec = out[0][k];
+			fields[i + k].min = out[1][k];
+			fields[i + k].hour = out[2][k];
+			fields[i + k].day = out[3][k];
+			fields[i + k].month = out[4][k];
+			fields[i + k].year = out[5][k];
+			fields[i + k].wday = out[6][k];
+			fields[i + k].yday = out[7][k];
+		}
+	}
+	tz_breakdown_scalar(&t[i], &fields[i], n - i);
+}
+#endif
+
+static void tz_breakdownbatch (const int64_t *t, struct tz_fields *fields, int n) {
+#if TZ_SIMD
+	if (tz_simd == TZ_SIMD_AVX2) {
+		tz_breakdown_avx2(t, fields, n);
+		return;
+	}
+#endif
+	tz_breakdown_scalar(t, fields, n);
+}
+
+static void tz_iso_scalar (const struct tz_fields *fields, const int32_t *offsets, char *out,
+		int n) {
+	int                      i, sign, off;
+	char                    *p;
+	const struct tz_fields  *f;
+
+	for (i = 0; i < n; i++) {
+		f = &fields[i];
+		p = &out[i * TZ_ISO_LENGTH];
+		sign = offsets[i] >> 31;  /* branchless; offsets of a batch may change sign */
+		off = ((offsets[i] ^ sign) - sign) / 60;
+		memcpy(p, "0000-00-00T00:00:00+00:00", TZ_ISO_LENGTH);
+		memcpy(&p[0], &DIGIT_PAIRS[f->year / 100 * 2], 2);
+		memcpy(&p[2], &DIGIT_PAIRS[f->year % 100 * 2], 2);
+		memcpy(&p[5], &DIGIT_PAIRS[f->month * 2], 2);
+		memcpy(&p[8], &DIGIT_PAIRS[f->day * 2], 2);
+		memcpy(&p[11], &DIGIT_PAIRS[f->hour * 2], 2);
+		memcpy(&p[14], &DIGIT_PAIRS[f->min * 2], 2);
+		memcpy(&p[17], &DIGIT_PAIRS[f->sec * 2], 2);
+		p[19] = '+' - 2 * sign;
+		memcpy(&p[20], &DIGIT_PAIRS[off / 60 * 2], 2);
+		memcpy(&p[23], &DIGIT_PAIRS[off % 60 * 2], 2);
+	}
+}
+
+#if TZ_SIMD
+/* Each record packs eight two-digit values into 16-bit lanes, splits them into tens and ones
+   with a multiply-high by 2^16 / 10, and shuffles the digits into place. The second store of a
+   record spills 7 bytes into the next record, so the output needs 7 bytes of slack. */
+__attribute__((target("avx2")))
+static void tz_iso_avx2 (const struct tz_fields *fields, const int32_t *offsets, char *out,
+		int n) {
+	int                      i, sign, off;
+	char                    *p;
+	__m128i                  v, tens, ones, digits, mask0, mask1, template0, template1;
+	const struct tz_fields  *f;
+
+	mask0 = _mm_setr_epi8(12, 13, 10, 11, -1, 8, 9, -1, 6, 7, -1, 4, 5, -1, 2, 3);
+	mask1 = _mm_setr_epi8(-1, 0, 1, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	template0 = _mm_setr_epi8(0, 0, 0, 0, '-', 0, 0, '-', 0, 0, 'T', 0, 0, ':', 0, 0);
+	template1 = _mm_setr_epi8(':', 0, 0, '+', 0, 0, ':', 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	for (i = 0; i < n; i++) {
+		/* lanes: sec, min, hour, day, month, year % 100, year / 100, offset hours */
+		f = &fields[i];
+		p = &out[i * TZ_ISO_LENGTH];
+		sign = offsets[i] >> 31;
+		off = ((offsets[i] ^ sign) - sign) / 60;
+		v = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)&f->sec),
+				_mm_loadu_si128((const __m128i *)&f->month));
+		v = _mm_insert_epi16(v, f->year % 100, 5);
+		v = _mm_insert_epi16(v, f->year / 100, 6);
+		v = _mm_insert_epi16(v, off / 60, 7);
+
+		/* ASCII digits, tens first */
+		tens = _mm_mulhi_epu16(v, _mm_set1_epi16(6554));
+		ones = _mm_sub_epi16(v, _mm_mullo_epi16(tens, _mm_set1_epi16(10)));
+		digits = _mm_add_epi8(_mm_or_si128(tens, _mm_slli_epi16(ones, 8)),
+				_mm_set1_epi8('0'));
+
+		/* place */
+		_mm_storeu_si128((__m128i *)p, _mm_or_si128(_mm_shuffle_epi8(digits, mask0),
+				template0));
+		_mm_storeu_si128((__m128i *)&p[16], _mm_or_si128(_mm_shuffle_epi8(digits, mask1),
+				template1));
+		p[19] = '+' - 2 * sign;
+		memcpy(&p[23], &DIGIT_PAIRS[off % 60 * 2], 2);
+	}
+}
+#endif
+
+static void tz_isobatch (const struct tz_fields *fields, const int32_t *offsets, char *out,
+		int n) {
+#if TZ_SIMD
+	if (tz_simd == TZ_SIMD_AVX2) {
+		tz_iso_avx2(fields, offsets, out, n);
+		return;
+	}
+#endif
+	tz_iso_scalar(fields, offsets, out, n);
+}
+
+static int tz_isoparse_scalar (const char *s, size_t width, int64_t *t, int n) {
+	int          i, k, v[TZ_ISO_LOCAL];
+	const char  *p;
+
+	for (i = 0; i < n; i++) {
+		p = &s[i * width];
+		for (k = 0; k < TZ_ISO_LOCAL; k++) {
+			v[k] = (unsigned char)p[k] - '0';
+		}
+		if (p[4] != '-' || p[7] != '-' || (p[10] != 'T' && p[10] != ' ') || p[13] != ':'
+				|| p[16] != ':') {
+			return i;
+		}
+		for (k = 0; k < TZ_ISO_LOCAL; k++) {
+			if (k != 4 && k != 7 && k != 10 && k != 13 && k != 16 && (v[k] < 0 || v[k] > 9)) {
+				return i;
+			}
+		}
+		if (!isotime(v[0] * 1000 + v[1] * 100 + v[2] * 10 + v[3], v[5] * 10 + v[6],
+				v[8] * 10 + v[9], v[11] * 10 + v[12], v[14] * 10 + v[15],
+				v[17] * 10 + v[18], &t[i])) {
+			return i;
+		}
+	}
+	return n;
+}
+
+#if TZ_SIMD
+/* Each record is loaded as bytes 0-15 and 3-18. The fourteen digits are shuffled together,
+   checked, and combined into two-digit values with a multiply-add, which are range checked
+   in one comparison. The loads stay within the record. */
+__attribute__((target("avx2")))
+static int tz_isoparse_avx2 (const char *s, size_t width, int64_t *t, int n) {
+	int          i;
+	__m128i      a, b, digits, pairs, shuffle_a, shuffle_b, separators, separatormask;
+	__m128i      weights, lower, upper;
+	const char  *p;
+
+	shuffle_a = _mm_setr_epi8(0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15, -1, -1, -1, -1);
+	shuffle_b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 14, 15, 14, 15);
+	separators = _mm_setr_epi8(0, 0, 0, 0, '-', 0, 0, '-', 0, 0, 0, 0, 0, ':', 0, 0);
+	separatormask = _mm_setr_epi8(0, 0, 0, 0, -1, 0, 0, -1, 0, 0, 0, 0, 0, -1, 0, 0);
+	weights = _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1);
+	lower = _mm_setr_epi16(0, 0, 1, 1, 0, 0, 0, 0);
+	upper = _mm_setr_epi16(99, 99, 12, 31, 23, 59, 59, 59);
+	for (i = 0; i < n; i++) {
+		/* separators */
+		p = &s[i * width];
+		a = _mm_loadu_si128((const __m128i *)p);
+		b = _mm_loadu_si128((const __m128i *)&p[3]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(a, separatormask), separators))
+				!= 0xffff || (p[10] != 'T' && p[10] != ' ') || p[16] != ':') {
+			return i;
+		}
+
+		/* digits and two-digit values */
+		digits = _mm_sub_epi8(_mm_or_si128(_mm_shuffle_epi8(a, shuffle_a),
+				_mm_shuffle_epi8(b, shuffle_b)), _mm_set1_epi8('0'));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits))
+				!= 0xffff) {
+			return i;
+		}
+		pairs = _mm_maddubs_epi16(digits, weights);
+		if (!_mm_testz_si128(_mm_or_si128(_mm_cmpgt_epi16(lower, pairs),
+				_mm_cmpgt_epi16(pairs, upper)), _mm_set1_epi8(-1))) {
+			return i;
+		}
+		if (!isotime(_mm_extract_epi16(pairs, 0) * 100 + _mm_extract_epi16(pairs, 1),
+				_mm_extract_epi16(pairs, 2), _mm_extract_epi16(pairs, 3),
+				_mm_extract_epi16(pairs, 4), _mm_extract_epi16(pairs, 5),
+				_mm_extract_epi16(pairs, 6), &t[i])) {
+			return i;
+		}
+	}
+	return n;
+}
+#endif
+
+static int tz_isoparsebatch (const char *s, size_t width, int64_t *t, int n) {
+#if TZ_SIMD
+	if (tz_simd == TZ_SIMD_AVX2) {
+		return tz_isoparse_avx2(s, width, t, n);
+	}
+#endif
+	return tz_isoparse_scalar(s, width, t, n);
+}
+
 
 /*
  * functions
  */
 
+static int tz_infobatch (lua_State *L) {
+	int              i, n, packed;
+	size_t           len, size;
+	int32_t         *index, *offsets;
+	int64_t         *t;
+	const char      *timezone, *buffer;
+	struct tz_data  *data;
+	struct tz_type  *type;
+
+	/* check arguments */
+	packed = lua_type(L, 1) == LUA_TSTRING && !lua_isnumber(L, 1);
+	if (packed) {
+		buffer = lua_tolstring(L, 1, &size);
+		luaL_argcheck(L, size % sizeof(int64_t) == 0, 1, "packed times expected");
+		n = size / sizeof(int64_t);
+	} else {
+		n = lua_rawlen(L, 1);
+	}
+	timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
+	data = tz_data(L, timezone, len);
+
+	/* gather times and search */
+	t = lua_newuserdata(L, n * (sizeof(int64_t) + sizeof(int32_t)) + 1);
+	index = (int32_t *)(t + n);
+	if (packed) {
+		memcpy(t, buffer, n * sizeof(int64_t));
+	} else {
+		for (i = 0; i < n; i++) {
+			t[i] = gettime(L, 1, i + 1);
+		}
+	}
+	tz_indexbatch(data, t, index, n);
+
+	/* packed offsets */
+	if (packed) {
+		offsets = index;
+		for (i = 0; i < n; i++) {
+			type = index[i] >= 0 ? &data->types[data->timetypes[index[i]]] : &data->types[0];
+			offsets[i] = type->gmtoff;
+		}
+		lua_pushlstring(L, (const char *)offsets, n * sizeof(int32_t));
+		return 1;
+	}
+
+	/* lists of offsets, DST flags, and abbreviations */
+	lua_createtable(L, n, 0);
+	lua_createtable(L, n, 0);
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		type = index[i] >= 0 ? &data->types[data->timetypes[index[i]]] : &data->types[0];
+		lua_pushinteger(L, type->gmtoff);
+		lua_rawseti(L, -4, i + 1);
+		lua_pushboolean(L, type->isdst);
+		lua_rawseti(L, -3, i + 1);
+		lua_pushstring(L, &data->chars[type->abbrind]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 3;
+}
+
 static int tz_info (lua_State *L) {
 	size_t           len;
 	int64_t          t;
@@ -400,17 +1673,17 @@ static int tz_info (lua_State *L) {
 	struct tz_data  *data;
 	struct tz_type  *type;
 
-	/* check arguments */
-	if (lua_isnoneornil(L, 1)) {
-		t = (int64_t)time(NULL);
-	} else {
-#if LUA_VERSION_NUM >= 503
-		t = (int64_t)luaL_checkinteger(L, 1);
-#else
-		t = (int64_t)luaL_checknumber(L, 1);
-#endif
+	/* batch? */
+	if (lua_istable(L, 1) || (lua_type(L, 1) == LUA_TSTRING && !lua_isnumber(L, 1))) {
+		return tz_infobatch(L);
 	}
+
+	/* check arguments */
+	t = opttime(L, 1);
 	timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
+	if (TZ_TRACING()) {
+		tz_trace_call(L, TZ_TRACE_INFO, t, timezone, len, NULL, NULL);
+	}
 
 	/* get time zone data, find type, and return time info */
 	data = tz_data(L, timezone, len);
@@ -421,197 +1694,3839 @@ static int tz_info (lua_State *L) {
 	return 3;
 }
 
-static int tz_date (lua_State *L) {
-	int              jd, l, n, i, j;
-	int              sec, min, hour, day, month, year, wday, yday;
-	char             buffer[256];
-	size_t           len;
-	int64_t          t;
-	struct tm        tm;
-	const char      *format, *timezone;
-	struct tz_data  *data;
-	struct tz_type  *type;
+static int tz_batchtimes (lua_State *L, const char **buffer) {
+	size_t  size;
 
-	/* process arguments */
-	format = luaL_optstring(L, 1, "%c");
-	if (lua_isnoneornil(L, 2)) {
-		t = (int64_t)time(NULL);
+	/* packed times, a list of times, or, as with tz.info, a single time */
+	*buffer = NULL;
+	if (lua_type(L, 1) == LUA_TSTRING && !lua_isnumber(L, 1)) {
+		*buffer = lua_tolstring(L, 1, &size);
+		luaL_argcheck(L, size % sizeof(int64_t) == 0, 1, "packed times expected");
+		return size / sizeof(int64_t);
+	}
+	if (!lua_istable(L, 1)) {
+		checktime(L, 1);
+		return 1;
+	}
+	return lua_rawlen(L, 1);
+}
+
+static void tz_batchgather (lua_State *L, const char *buffer, int64_t *t, int first, int n) {
+	int  i;
+
+	if (buffer) {
+		memcpy(t, &buffer[first * sizeof(int64_t)], n * sizeof(int64_t));
+	} else if (!lua_istable(L, 1)) {
+		t[0] = checktime(L, 1);
 	} else {
-#if LUA_VERSION_NUM >= 503
-		t = (int64_t)luaL_checkinteger(L, 2);
-#else
-		t = (int64_t)luaL_checknumber(L, 2);
-#endif
+		for (i = 0; i < n; i++) {
+			t[i] = gettime(L, 1, first + i + 1);
+		}
 	}
-	timezone = luaL_optlstring(L, 3, TZ_LOCALTIME, &len);
-	if (*format == '!') {
-		timezone = TZ_UTC;
-		len = sizeof(TZ_UTC) - 1;
-		format++;
+}
+
+static int tz_breakdownfn (lua_State *L) {
+	int                i, n;
+	size_t             len;
+	int32_t           *index;
+	int64_t           *t;
+	const char        *timezone, *buffer;
+	struct tz_data    *data;
+	struct tz_fields  *fields;
+
+	/* check arguments */
+	n = tz_batchtimes(L, &buffer);
+	timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
+	data = tz_data(L, timezone, len);
+
+	/* gather times, apply offsets, and break down */
+	t = lua_newuserdata(L, n * (sizeof(int64_t) + sizeof(int32_t) + sizeof(struct tz_fields))
+			+ 1);
+	index = (int32_t *)(t + n);
+	fields = (struct tz_fields *)(index + n);
+	tz_batchgather(L, buffer, t, 0, n);
+	tz_indexbatch(data, t, index, n);
+	for (i = 0; i < n; i++) {
+		t[i] += index[i] >= 0 ? data->types[data->timetypes[index[i]]].gmtoff
+				: data->types[0].gmtoff;
 	}
+	tz_breakdownbatch(t, fields, n);
+	lua_pushlstring(L, (const char *)fields, n * sizeof(struct tz_fields));
+	return 1;
+}
 
-	/* get timezone data, find type, and apply offset */
+static int tz_isoformat (lua_State *L) {
+	int                i, j, n, m;
+	char              *out;
+	size_t             len;
+	int32_t            offsets[TZ_BATCH_CHUNK];
+	int64_t            t[TZ_BATCH_CHUNK];
+	const char        *timezone, *buffer;
+	struct tz_data    *data;
+	struct tz_fields   fields[TZ_BATCH_CHUNK];
+
+	/* check arguments */
+	n = tz_batchtimes(L, &buffer);
+	timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
 	data = tz_data(L, timezone, len);
-	type = tz_find(data, t, -1, 0);
-	t += type->gmtoff;
 
-	/* make date */
-	if (t >= TZ_J0_TIME) {
-		sec = t % 86400;
-		if (sec < 0) {
-			sec += 86400;
-		}
-		hour = sec / 3600;
-		sec %= 3600;
-		min = sec / 60;
-		sec %= 60;
-		/* source: Henry F. Fliegel, Thomas C. van Flandern:
-		   Letters to the editor: a machine algorithm for processing
-		   calendar dates. Commun. ACM 11(10): 657 (1968) */
-		if (t < 0) {
-			t -= 86399;
-		}
-		jd = t / 86400 + TZ_EPOCH;  /* Julian day */
-		l = jd + 68569;
-		n = (4 * l) / 146097;
-		l = l - (146097 * n + 3) / 4;
-		i = (4000 * (l + 1)) / 1461001;
-		l = l - (1461 * i) / 4 + 31;
-		j = (80 * l) / 2447;
-		day = l - (2447 * j) / 80;
-		l = j / 11;
-		month = j + 2 - (12 * l);
-		year = 100 * (n - 49) + i + l;
-		wday = (jd + 1) % 7 + 1;
-		yday = 0;
-		for (i = 1; i < month; i++) {
-			yday += days(year, i);
-		}
-		yday += day;
-		if (strcmp(format, "*t") == 0) {
-			lua_createtable(L, 0, 11);
-			setfield(L, "sec", sec);
-			setfield(L, "min", min);
-			setfield(L, "hour", hour);
-			setfield(L, "day", day);
-			setfield(L, "month", month);
-			setfield(L, "year", year);
-			setfield(L, "wday", wday);
-			setfield(L, "yday", yday);
-			lua_pushboolean(L, type->isdst);
-			lua_setfield(L, -2, "isdst");
-			setfield(L, "off", type->gmtoff);
-			lua_pushstring(L, &data->chars[type->abbrind]);
-			lua_setfield(L, -2, "zone");
-		} else {
-			tm.tm_sec = sec;
-			tm.tm_min = min;
-			tm.tm_hour = hour;
-			tm.tm_mday = day;
-			tm.tm_mon = month - 1;
-			tm.tm_year = year - 1900;
-			tm.tm_wday = wday - 1;
-			tm.tm_yday = yday - 1;
-			tm.tm_isdst = type->isdst;
-#if defined(_BSD_SOURCE) || defined(_DEFAULT_SOURCE)
-			tm.tm_gmtoff = type->gmtoff;
-			tm.tm_zone = &data->chars[type->abbrind];
-#endif
-			if (strftime(buffer, sizeof(buffer), format, &tm)) {
-				lua_pushstring(L, buffer);
-			} else {
-				return luaL_error(L, "format too long");
+	/* format in chunks, keeping the working set in cache; records spill into the next */
+	out = lua_newuserdata(L, n * TZ_ISO_LENGTH + 16);
+	for (i = 0; i < n; i += m) {
+		m = n - i < TZ_BATCH_CHUNK ? n - i : TZ_BATCH_CHUNK;
+		tz_batchgather(L, buffer, t, i, m);
+		tz_indexbatch(data, t, offsets, m);
+		for (j = 0; j < m; j++) {
+			offsets[j] = offsets[j] >= 0 ? data->types[data->timetypes[offsets[j]]].gmtoff
+					: data->types[0].gmtoff;
+			t[j] += offsets[j];
+			if (t[j] < TZ_ISO_MIN || t[j] >= TZ_ISO_MAX) {
+				return luaL_error(L, "element %d out of range", i + j + 1);
 			}
 		}
-	} else {
-		lua_pushnil(L);
+		tz_breakdownbatch(t, fields, m);
+		tz_isobatch(fields, offsets, &out[i * TZ_ISO_LENGTH], m);
 	}
+	lua_pushlstring(L, out, n * TZ_ISO_LENGTH);
 	return 1;
 }
 
-static int tz_time (lua_State *L) {
-	int              isdst, hastimezone, hasoff;
-	int              sec, min, hour, day, month, year;
-	size_t           len;
-	int64_t          t;
-	const char      *timezone;
+static int tz_isoparse (lua_State *L) {
+	int              i, n;
+	size_t           len, width;
+	int32_t          off, fixed;
+	int64_t         *t;
+	const char      *s, *r, *timezone;
 	struct tz_data  *data;
-	struct tz_type  *type;
 
-        if (lua_isnoneornil(L, 1)) {
-		t = (int64_t)time(NULL);
-		if (t == -1) {
-			lua_pushnil(L);
-			return 1;
-		}
+	/* check arguments */
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		s = lua_tolstring(L, 1, &len);
+		width = len > TZ_ISO_LOCAL && s[TZ_ISO_LOCAL] == 'Z' ? TZ_ISO_LOCAL + 1
+				: len > TZ_ISO_LOCAL && (s[TZ_ISO_LOCAL] == '+' || s[TZ_ISO_LOCAL] == '-')
+				? TZ_ISO_LENGTH : TZ_ISO_LOCAL;
+		width = luaL_optinteger(L, 3, width);
+		luaL_argcheck(L, width == TZ_ISO_LOCAL || width == TZ_ISO_LOCAL + 1
+				|| width == TZ_ISO_LENGTH, 3, "invalid width");
+		luaL_argcheck(L, len % width == 0, 1, "fixed-width records expected");
+		n = len / width;
 	} else {
-		/* process arguments */
 		luaL_checktype(L, 1, LUA_TTABLE);
+		s = NULL;
+		width = 0;
+		n = lua_rawlen(L, 1);
+	}
+	data = NULL;
+	fixed = 0;
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		fixed = (int32_t)luaL_checkinteger(L, 2);
+	} else {
 		timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
-		hastimezone = !lua_isnoneornil(L, 2);
+		data = tz_data(L, timezone, len);
+	}
 
-		/* get time in UTC */
-		sec = getfield(L, 1, "sec", 0);
-		min = getfield(L, 1, "min", 0);
-		hour = getfield(L, 1, "hour", 12);
-		day = getfield(L, 1, "day", -1);
-		month = getfield(L, 1, "month", -1);
-		year = getfield(L, 1, "year", -1);
-		lua_getfield(L, 1, "isdst");
-		isdst = !lua_isnil(L, -1) ? lua_toboolean(L, -1): -1;
-		lua_getfield(L, 1, "off");
-		hasoff = !lua_isnil(L, -1);
-		lua_pop(L, 2);
-		if (month < 1) {
-			year += (month - 12) / 12;
-			month = month % 12 + 12;
-		}
-		if (month > 12) {
-			year += (month - 1) / 12;
-			month = (month - 1) % 12 + 1;
-		}
-		/* source: Henry F. Fliegel, Thomas C. van Flandern:
-		   Letters to the editor: a machine algorithm for processing
-		   calendar dates. Commun. ACM 11(10): 657 (1968) */
-		if (year >= TZ_J0_YEAR) {
-			t  = ((1461 * (year + 4800 + (month - 14) / 12)) / 4
-					+ (367 * (month - 2 - 12 * ((month - 14)
-					/ 12))) / 12 - (3 * ((year + 4900
-					+ (month - 14) / 12) / 100)) / 4
-					+ day - 32075     /* Julian day */
-					- TZ_EPOCH)    /* epoch */
-					* (int64_t)86400  /* days */
-					+ hour * 3600     /* hours */
-					+ min * 60        /* minutes */
-					+ sec;            /* seconds */
+	/* parse local times; the records of a string are parsed as a batch */
+	t = lua_newuserdata(L, n * sizeof(int64_t) + 1);
+	if (s && (i = tz_isoparsebatch(s, width, t, n)) < n) {
+		return luaL_error(L, "element %d is not an ISO 8601 date and time", i + 1);
+	}
+	for (i = 0; i < n; i++) {
+		if (s) {
+			r = &s[i * width];
+			len = width;
 		} else {
-			lua_pushnil(L);
-			return 1;
+			lua_rawgeti(L, 1, i + 1);
+			if (lua_type(L, -1) != LUA_TSTRING) {
+				return luaL_error(L, "element %d has wrong type (string expected, got %s)",
+						i + 1, luaL_typename(L, -1));
+			}
+			r = lua_tolstring(L, -1, &len);
+			lua_pop(L, 1);  /* the table keeps the string */
+			if (len < TZ_ISO_LOCAL || tz_isoparsebatch(r, len, &t[i], 1) != 1) {
+				return luaL_error(L, "element %d is not an ISO 8601 date and time", i + 1);
+			}
 		}
 
-		/* adjust */
-		if (hasoff && !hastimezone) {
-			t -= getfield(L, 1, "off", -1);
+		/* apply the offset of the record, or the zone */
+		if (len > TZ_ISO_LOCAL) {
+			if (!isooffset(&r[TZ_ISO_LOCAL], len - TZ_ISO_LOCAL, &off)) {
+				return luaL_error(L, "element %d is not an ISO 8601 date and time", i + 1);
+			}
+			t[i] -= off;
+		} else if (data) {
+			t[i] -= tz_find(data, t[i], -1, 1)->gmtoff;
 		} else {
-			data = tz_data(L, timezone, len);
-			type = tz_find(data, t, isdst, 1);
-			t -= type->gmtoff;
-		}
-		if (t < TZ_J0_TIME) {
-			lua_pushnil(L);
-			return 1;
+			t[i] -= fixed;
 		}
 	}
-#if LUA_VERSION_NUM >= 503
-	lua_pushinteger(L, (lua_Integer)t);
-#else
-	lua_pushnumber(L, (lua_Number)t);
-#endif
+	lua_pushlstring(L, (const char *)t, n * sizeof(int64_t));
 	return 1;
 }
 
+static int tz_strategyinfo (lua_State *L) {
+	size_t           len;
+	const char      *timezone;
+	struct tz_data  *data;
+	static const char *const strategies[] = { "const", "linear", "bucket" };
 
-/*
+	/* check arguments */
+	timezone = luaL_optlstring(L, 1, TZ_LOCALTIME, &len);
+
+	/* return strategy and number of transitions */
+	data = tz_data(L, timezone, len);
+	lua_pushstring(L, strategies[data->strategy]);
+	lua_pushinteger(L, data->header.timecnt);
+	return 2;
+}
+
+static struct tz_period *tz_period (struct tz_data *data, int granularity, int64_t t) {
+	int                index;
+	int64_t            local, from, to;
+	struct tz_type    *type;
+	struct tz_period  *period;
+	struct tz_fields   fields;
+
+	/* cached? */
+	period = &data->periods[granularity];
+	if (t >= period->from && t < period->to) {
+		return period;
+	}
+
+	/* find type and break down */
+	index = tz_index(data, t);
+	type = index >= 0 ? &data->types[data->timetypes[index]] : &data->types[0];
+	local = t + type->gmtoff;
+	if (local < TZ_J0_TIME) {
+		return NULL;
+	}
+	tz_breakdown(local, &fields);
+
+	/* local period */
+	switch (granularity) {
+	case TZ_PERIOD_YEAR:
+		from = epochday(fields.year, 1, 1) * 86400;
+		to = epochday(fields.year + 1, 1, 1) * 86400;
+		period->key = fields.year;
+		period->pathlen = snprintf(period->path, sizeof(period->path), "year=%d",
+				fields.year);
+		break;
+
+	case TZ_PERIOD_MONTH:
+		from = epochday(fields.year, fields.month, 1) * 86400;
+		to = from + days(fields.year, fields.month) * 86400;
+		period->key = (int64_t)fields.year * 100 + fields.month;
+		period->pathlen = snprintf(period->path, sizeof(period->path), "year=%d/month=%02d",
+				fields.year, fields.month);
+		break;
+
+	case TZ_PERIOD_DAY:
+		from = local - (fields.hour * 3600 + fields.min * 60 + fields.sec);
+		to = from + 86400;
+		period->key = ((int64_t)fields.year * 100 + fields.month) * 100 + fields.day;
+		period->pathlen = snprintf(period->path, sizeof(period->path),
+				"year=%d/month=%02d/day=%02d", fields.year, fields.month, fields.day);
+		break;
+
+	default:
+		from = local - (fields.min * 60 + fields.sec);
+		to = from + 3600;
+		period->key = (((int64_t)fields.year * 100 + fields.month) * 100 + fields.day) * 100
+				+ fields.hour;
+		period->pathlen = snprintf(period->path, sizeof(period->path),
+				"year=%d/month=%02d/day=%02d/hour=%02d", fields.year, fields.month,
+				fields.day, fields.hour);
+	}
+
+	/* UTC range, within the transitions around the time */
+	period->from = from - type->gmtoff;
+	period->to = to - type->gmtoff;
+	if (index >= 0 && period->from < data->timevalues[index]) {
+		period->from = data->timevalues[index];
+	}
+	if (index + 1 < data->header.timecnt && period->to > data->timevalues[index + 1]) {
+		period->to = data->timevalues[index + 1];
+	}
+	return period;
+}
+
+static struct tz_data *tz_periodargs (lua_State *L, int *granularity) {
+	size_t              len;
+	const char         *timezone;
+	static const char  *const granularities[] = { "year", "month", "day", "hour", NULL };
+
+	timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
+	*granularity = luaL_checkoption(L, 3, "day", granularities);
+	return tz_data(L, timezone, len);
+}
+
+static int tz_datekey (lua_State *L) {
+	int                i, n, granularity;
+	size_t             size;
+	int64_t           *keys;
+	const char        *buffer;
+	struct tz_data    *data;
+	struct tz_period  *period;
+
+	/* single */
+	if (!lua_istable(L, 1) && (lua_type(L, 1) != LUA_TSTRING || lua_isnumber(L, 1))) {
+		data = tz_periodargs(L, &granularity);
+		period = tz_period(data, granularity, opttime(L, 1));
+		if (period) {
+			pushtime(L, period->key);
+		} else {
+			lua_pushnil(L);
+		}
+		return 1;
+	}
+
+	/* packed times */
+	data = tz_periodargs(L, &granularity);
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		buffer = lua_tolstring(L, 1, &size);
+		luaL_argcheck(L, size % sizeof(int64_t) == 0, 1, "packed times expected");
+		n = size / sizeof(int64_t);
+		keys = lua_newuserdata(L, size + 1);
+		memcpy(keys, buffer, size);
+		for (i = 0; i < n; i++) {
+			period = tz_period(data, granularity, keys[i]);
+			keys[i] = period ? period->key : 0;
+		}
+		lua_pushlstring(L, (const char *)keys, size);
+		return 1;
+	}
+
+	/* list of times */
+	n = lua_rawlen(L, 1);
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		period = tz_period(data, granularity, gettime(L, 1, i + 1));
+		if (period) {
+			pushtime(L, period->key);
+			lua_rawseti(L, -2, i + 1);
+		}
+	}
+	return 1;
+}
+
+static int tz_datepath (lua_State *L) {
+	int                i, n, granularity, pushed;
+	int64_t            t;
+	struct tz_data    *data;
+	struct tz_period  *period;
+
+	/* single */
+	data = tz_periodargs(L, &granularity);
+	if (!lua_istable(L, 1)) {
+		period = tz_period(data, granularity, opttime(L, 1));
+		if (period) {
+			lua_pushlstring(L, period->path, period->pathlen);
+		} else {
+			lua_pushnil(L);
+		}
+		return 1;
+	}
+
+	/* list of times; the path string is reused while the period is unchanged */
+	n = lua_rawlen(L, 1);
+	lua_createtable(L, n, 0);
+	lua_pushnil(L);
+	period = &data->periods[granularity];
+	pushed = 0;
+	for (i = 0; i < n; i++) {
+		t = gettime(L, 1, i + 1);
+		if (!pushed || t < period->from || t >= period->to) {
+			if (!tz_period(data, granularity, t)) {
+				continue;
+			}
+			lua_pop(L, 1);
+			lua_pushlstring(L, period->path, period->pathlen);
+			pushed = 1;
+		}
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, i + 1);
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+static int tz_dateformat (lua_State *L, const char *format, struct tz_data *data,
+		struct tz_type *type, struct tz_fields *fields) {
+	char       buffer[256];
+	struct tm  tm;
+
+	TZ_PROBE1(date__start, format);
+	if (!fields) {
+		lua_pushnil(L);
+	} else if (strcmp(format, "*t") == 0) {
+		lua_createtable(L, 0, 11);
+		setfield(L, "sec", fields->sec);
+		setfield(L, "min", fields->min);
+		setfield(L, "hour", fields->hour);
+		setfield(L, "day", fields->day);
+		setfield(L, "month", fields->month);
+		setfield(L, "year", fields->year);
+		setfield(L, "wday", fields->wday);
+		setfield(L, "yday", fields->yday);
+		lua_pushboolean(L, type->isdst);
+		lua_setfield(L, -2, "isdst");
+		setfield(L, "off", type->gmtoff);
+		lua_pushstring(L, &data->chars[type->abbrind]);
+		lua_setfield(L, -2, "zone");
+	} else {
+		tm.tm_sec = fields->sec;
+		tm.tm_min = fields->min;
+		tm.tm_hour = fields->hour;
+		tm.tm_mday = fields->day;
+		tm.tm_mon = fields->month - 1;
+		tm.tm_year = fields->year - 1900;
+		tm.tm_wday = fields->wday - 1;
+		tm.tm_yday = fields->yday - 1;
+		tm.tm_isdst = type->isdst;
+#if defined(_BSD_SOURCE) || defined(_DEFAULT_SOURCE)
+		tm.tm_gmtoff = type->gmtoff;
+		tm.tm_zone = &data->chars[type->abbrind];
+#endif
+		if (strftime(buffer, sizeof(buffer), format, &tm)) {
+			lua_pushstring(L, buffer);
+		} else {
+			TZ_PROBE1(date__end, format);
+			return luaL_error(L, "format too long");
+		}
+	}
+	TZ_PROBE1(date__end, format);
+	return 1;
+}
+
+static int tz_datemulti (lua_State *L) {
+	int               i, n;
+	size_t            len;
+	int64_t           t, local, utclocal;
+	const char       *format, *timezone;
+	struct tz_data   *data, *utcdata;
+	struct tz_type   *type, *utctype;
+	struct tz_fields  fields, utcfields;
+
+	/* process arguments */
+	n = lua_rawlen(L, 1);
+	t = opttime(L, 2);
+	timezone = luaL_optlstring(L, 3, TZ_LOCALTIME, &len);
+	luaL_checkstack(L, n + LUA_MINSTACK, "too many formats");
+
+	/* get timezone data, find type, apply offset, and break down once */
+	data = tz_data(L, timezone, len);
+	type = tz_find(data, t, -1, 0);
+	local = t + type->gmtoff;
+	if (local >= TZ_J0_TIME) {
+		tz_breakdown(local, &fields);
+	}
+
+	/* make dates; formats starting with '!' share a breakdown in UTC */
+	utcdata = NULL;
+	utctype = NULL;
+	utclocal = 0;
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 1, i);
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			return luaL_error(L, "element %d has wrong type (string expected, got %s)", i,
+					luaL_typename(L, -1));
+		}
+		format = lua_tostring(L, -1);
+		lua_pop(L, 1);  /* the table keeps the format */
+		if (TZ_TRACING()) {
+			tz_trace_call(L, TZ_TRACE_DATE, t, timezone, len, format, NULL);
+		}
+		if (*format == '!') {
+			if (!utcdata) {
+				utcdata = tz_data(L, TZ_UTC, sizeof(TZ_UTC) - 1);
+				lua_pop(L, 1);  /* the TZ table keeps the data */
+				utctype = tz_find(utcdata, t, -1, 0);
+				utclocal = t + utctype->gmtoff;
+				if (utclocal >= TZ_J0_TIME) {
+					tz_breakdown(utclocal, &utcfields);
+				}
+			}
+			tz_dateformat(L, format + 1, utcdata, utctype,
+					utclocal >= TZ_J0_TIME ? &utcfields : NULL);
+		} else {
+			tz_dateformat(L, format, data, type, local >= TZ_J0_TIME ? &fields : NULL);
+		}
+	}
+	return n;
+}
+
+static int tz_date (lua_State *L) {
+	size_t            len;
+	int64_t           t;
+	const char       *format, *timezone;
+	struct tz_data   *data;
+	struct tz_type   *type;
+	struct tz_fields  fields;
+
+	/* several formats? */
+	if (lua_istable(L, 1)) {
+		return tz_datemulti(L);
+	}
+
+	/* process arguments */
+	format = luaL_optstring(L, 1, "%c");
+	t = opttime(L, 2);
+	timezone = luaL_optlstring(L, 3, TZ_LOCALTIME, &len);
+	if (TZ_TRACING()) {
+		tz_trace_call(L, TZ_TRACE_DATE, t, timezone, len, format, NULL);
+	}
+	if (*format == '!') {
+		timezone = TZ_UTC;
+		len = sizeof(TZ_UTC) - 1;
+		format++;
+	}
+
+	/* get timezone data, find type, and apply offset */
+	data = tz_data(L, timezone, len);
+	type = tz_find(data, t, -1, 0);
+	t += type->gmtoff;
+
+	/* make date */
+	if (t >= TZ_J0_TIME) {
+		tz_breakdown(t, &fields);
+		return tz_dateformat(L, format, data, type, &fields);
+	}
+	return tz_dateformat(L, format, data, type, NULL);
+}
+
+static int tz_time (lua_State *L) {
+	int              isdst, hastimezone, hasoff;
+	int32_t          fields[TZ_TRACE_FIELDS];
+	int              sec, min, hour, day, month, year;
+	size_t           len;
+	int64_t          t;
+	const char      *timezone;
+	struct tz_data  *data;
+	struct tz_type  *type;
+
+        if (lua_isnoneornil(L, 1)) {
+		t = (int64_t)time(NULL);
+		if (t == -1) {
+			lua_pushnil(L);
+			return 1;
+		}
+	} else {
+		/* process arguments */
+		luaL_checktype(L, 1, LUA_TTABLE);
+		timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
+		hastimezone = !lua_isnoneornil(L, 2);
+
+		/* get time in UTC */
+		sec = getfield(L, 1, "sec", 0);
+		min = getfield(L, 1, "min", 0);
+		hour = getfield(L, 1, "hour", 12);
+		day = getfield(L, 1, "day", -1);
+		month = getfield(L, 1, "month", -1);
+		year = getfield(L, 1, "year", -1);
+		lua_getfield(L, 1, "isdst");
+		isdst = !lua_isnil(L, -1) ? lua_toboolean(L, -1): -1;
+		lua_getfield(L, 1, "off");
+		hasoff = !lua_isnil(L, -1);
+		lua_pop(L, 2);
+		if (TZ_TRACING()) {
+			fields[0] = year;
+			fields[1] = month;
+			fields[2] = day;
+			fields[3] = hour;
+			fields[4] = min;
+			fields[5] = sec;
+			fields[6] = isdst;
+			fields[7] = hastimezone | hasoff << 1;
+			fields[8] = hasoff ? getfield(L, 1, "off", -1) : 0;
+			tz_trace_call(L, TZ_TRACE_TIME, 0, timezone, len, NULL, fields);
+		}
+		if (month < 1) {
+			year += (month - 12) / 12;
+			month = month % 12 + 12;
+		}
+		if (month > 12) {
+			year += (month - 1) / 12;
+			month = (month - 1) % 12 + 1;
+		}
+		if (year >= TZ_J0_YEAR) {
+			t = epochday(year, month, day)
+					* (int64_t)86400  /* days */
+					+ hour * 3600     /* hours */
+					+ min * 60        /* minutes */
+					+ sec;            /* seconds */
+		} else {
+			lua_pushnil(L);
+			return 1;
+		}
+
+		/* adjust */
+		if (hasoff && !hastimezone) {
+			t -= getfield(L, 1, "off", -1);
+		} else {
+			data = tz_data(L, timezone, len);
+			type = tz_find(data, t, isdst, 1);
+			t -= type->gmtoff;
+		}
+		if (t < TZ_J0_TIME) {
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+	pushtime(L, t);
+	return 1;
+}
+
+static int tz_diffone (struct tz_data *data, int unit, int64_t t1, int64_t t2, int64_t *result) {
+	int64_t           local1, local2, day1, day2, rest1, rest2, diff;
+	struct tz_fields  fields1, fields2;
+
+	/* elapsed units */
+	switch (unit) {
+	case TZ_UNIT_HOUR:
+		*result = (t2 - t1) / 3600;
+		return 1;
+
+	case TZ_UNIT_MIN:
+		*result = (t2 - t1) / 60;
+		return 1;
+
+	case TZ_UNIT_SEC:
+		*result = t2 - t1;
+		return 1;
+	}
+
+	/* calendar units */
+	local1 = t1 + tz_find(data, t1, -1, 0)->gmtoff;
+	local2 = t2 + tz_find(data, t2, -1, 0)->gmtoff;
+	if (local1 < TZ_J0_TIME || local2 < TZ_J0_TIME) {
+		return 0;
+	}
+	day1 = floordiv(local1, 86400);
+	day2 = floordiv(local2, 86400);
+	if (unit == TZ_UNIT_DAY || unit == TZ_UNIT_WEEK) {
+		diff = day2 - day1;
+		rest1 = local1 - day1 * 86400;
+		rest2 = local2 - day2 * 86400;
+	} else {
+		tz_breakdown(local1, &fields1);
+		tz_breakdown(local2, &fields2);
+		diff = (fields2.year - fields1.year) * (int64_t)12 + fields2.month - fields1.month;
+		rest1 = (fields1.day - 1) * (int64_t)86400 + (local1 - day1 * 86400);
+		rest2 = (fields2.day - 1) * (int64_t)86400 + (local2 - day2 * 86400);
+	}
+
+	/* count complete units only */
+	if (diff > 0 && rest2 < rest1) {
+		diff--;
+	} else if (diff < 0 && rest2 > rest1) {
+		diff++;
+	}
+	switch (unit) {
+	case TZ_UNIT_YEAR:
+		*result = diff / 12;
+		break;
+
+	case TZ_UNIT_WEEK:
+		*result = diff / 7;
+		break;
+
+	default:
+		*result = diff;
+	}
+	return 1;
+}
+
+static int tz_diff (lua_State *L) {
+	static const char *const units[] = { "year", "month", "week", "day", "hour", "min", "sec",
+			NULL };
+	int              i, n, unit;
+	size_t           len;
+	int64_t          t1, t2, result;
+	const char      *timezone;
+	struct tz_data  *data;
+
+	/* check arguments */
+	t1 = t2 = 0;
+	if (!lua_istable(L, 1)) {
+		t1 = checktime(L, 1);
+	}
+	if (!lua_istable(L, 2)) {
+		t2 = checktime(L, 2);
+	}
+	unit = luaL_checkoption(L, 3, NULL, units);
+	timezone = luaL_optlstring(L, 4, TZ_LOCALTIME, &len);
+	data = tz_data(L, timezone, len);
+
+	/* single */
+	if (!lua_istable(L, 1) && !lua_istable(L, 2)) {
+		if (tz_diffone(data, unit, t1, t2, &result)) {
+			pushtime(L, result);
+		} else {
+			lua_pushnil(L);
+		}
+		return 1;
+	}
+
+	/* batch */
+	n = lua_istable(L, 1) ? (int)lua_rawlen(L, 1) : (int)lua_rawlen(L, 2);
+	if (lua_istable(L, 1) && lua_istable(L, 2) && (int)lua_rawlen(L, 2) != n) {
+		return luaL_error(L, "batch sizes differ");
+	}
+	lua_createtable(L, n, 0);
+	for (i = 1; i <= n; i++) {
+		if (lua_istable(L, 1)) {
+			t1 = gettime(L, 1, i);
+		}
+		if (lua_istable(L, 2)) {
+			t2 = gettime(L, 2, i);
+		}
+		if (tz_diffone(data, unit, t1, t2, &result)) {
+			pushtime(L, result);
+		} else {
+			lua_pushboolean(L, 0);
+		}
+		lua_rawseti(L, -2, i);
+	}
+	return 1;
+}
+
+static int tz_delta (lua_State *L) {
+	int              i, j, count;
+	size_t           len1, len2;
+	int64_t          from, to, t;
+	int32_t          delta, last;
+	const char      *timezone1, *timezone2;
+	struct tz_data  *data1, *data2;
+	struct tz_type  *type1, *type2;
+
+	/* check arguments */
+	timezone1 = luaL_checklstring(L, 1, &len1);
+	timezone2 = luaL_checklstring(L, 2, &len2);
+	from = checktime(L, 3);
+	to = checktime(L, 4);
+	lua_settop(L, 4);
+
+	/* get time zone data */
+	data1 = tz_data(L, timezone1, len1);
+	data2 = tz_data(L, timezone2, len2);
+
+	/* merge the transitions of both time zones */
+	lua_newtable(L);
+	count = 0;
+	i = tz_index(data1, from);
+	j = tz_index(data2, from);
+	t = from;
+	last = 0;
+	while (t < to) {
+		type1 = i >= 0 ? &data1->types[data1->timetypes[i]] : &data1->types[0];
+		type2 = j >= 0 ? &data2->types[data2->timetypes[j]] : &data2->types[0];
+		delta = type2->gmtoff - type1->gmtoff;
+		if (count == 0 || delta != last) {
+			lua_createtable(L, 2, 0);
+			pushtime(L, t);
+			lua_rawseti(L, -2, 1);
+			lua_pushinteger(L, delta);
+			lua_rawseti(L, -2, 2);
+			lua_rawseti(L, -2, ++count);
+			last = delta;
+		}
+		if (i + 1 < data1->header.timecnt && (j + 1 >= data2->header.timecnt
+				|| data1->timevalues[i + 1] <= data2->timevalues[j + 1])) {
+			t = data1->timevalues[++i];
+			if (j + 1 < data2->header.timecnt && data2->timevalues[j + 1] == t) {
+				j++;
+			}
+		} else if (j + 1 < data2->header.timecnt) {
+			t = data2->timevalues[++j];
+		} else {
+			break;
+		}
+	}
+	return 1;
+}
+
+static int tz_overlap (lua_State *L) {
+	int               i, j, k, n, count, spancnt, tmpcnt, index;
+	size_t            len;
+	int64_t           start, end, from, to, next, day, open, close, pending[2];
+	int64_t          *spans, *tmp, *swap, arcs[4];
+	const char       *timezone;
+	struct tz_data  **data;
+	struct tz_type   *type;
+
+	/* check arguments */
+	luaL_checktype(L, 1, LUA_TTABLE);
+	start = checktime(L, 2);
+	end = checktime(L, 3);
+	from = checktime(L, 4);
+	to = checktime(L, 5);
+	luaL_argcheck(L, start >= 0 && start <= 86400, 2, "invalid local time");
+	luaL_argcheck(L, end >= 0 && end <= 86400 && end != start, 3, "invalid local time");
+	n = lua_rawlen(L, 1);
+	luaL_argcheck(L, n > 0, 1, "no time zones");
+	lua_settop(L, 5);
+
+	/* get time zone data and allocate spans */
+	data = lua_newuserdata(L, n * sizeof(struct tz_data *));
+	spans = lua_newuserdata(L, 2 * (2 * n + 1) * sizeof(int64_t));
+	tmp = lua_newuserdata(L, 2 * (2 * n + 1) * sizeof(int64_t));
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		timezone = lua_tolstring(L, -1, &len);
+		if (!timezone) {
+			return luaL_error(L, "time zone has wrong type (string expected, got %s)",
+					luaL_typename(L, -1));
+		}
+		data[i] = tz_data(L, timezone, len);
+		lua_pop(L, 2);
+	}
+
+	/* process segments of constant offsets */
+	lua_newtable(L);
+	count = 0;
+	pending[0] = pending[1] = INT64_MIN;
+	while (from < to) {
+		/* intersect the windows of the time zones, in UTC seconds of day */
+		spans[0] = 0;
+		spans[1] = 86400;
+		spancnt = 1;
+		next = to;
+		for (i = 0; i < n; i++) {
+			index = tz_index(data[i], from);
+			type = index >= 0 ? &data[i]->types[data[i]->timetypes[index]]
+					: &data[i]->types[0];
+			if (index + 1 < data[i]->header.timecnt && data[i]->timevalues[index + 1] < next) {
+				next = data[i]->timevalues[index + 1];
+			}
+			open = (start - type->gmtoff) % 86400;
+			if (open < 0) {
+				open += 86400;
+			}
+			close = open + (end > start ? end - start : end - start + 86400);
+			if (close <= 86400) {
+				arcs[0] = open;
+				arcs[1] = close;
+				k = 1;
+			} else {
+				arcs[0] = 0;
+				arcs[1] = close - 86400;
+				arcs[2] = open;
+				arcs[3] = 86400;
+				k = 2;
+			}
+			tmpcnt = 0;
+			for (j = 0; j < spancnt; j++) {
+				for (index = 0; index < k; index++) {
+					open = spans[2 * j] > arcs[2 * index] ? spans[2 * j] : arcs[2 * index];
+					close = spans[2 * j + 1] < arcs[2 * index + 1] ? spans[2 * j + 1]
+							: arcs[2 * index + 1];
+					if (open < close) {
+						tmp[2 * tmpcnt] = open;
+						tmp[2 * tmpcnt + 1] = close;
+						tmpcnt++;
+					}
+				}
+			}
+			swap = spans;
+			spans = tmp;
+			tmp = swap;
+			spancnt = tmpcnt;
+		}
+
+		/* emit the intersection for each UTC day of the segment */
+		for (day = floordiv(from, 86400); spancnt > 0 && day * 86400 < next; day++) {
+			for (j = 0; j < spancnt; j++) {
+				open = day * 86400 + spans[2 * j];
+				close = day * 86400 + spans[2 * j + 1];
+				if (open < from) {
+					open = from;
+				}
+				if (close > next) {
+					close = next;
+				}
+				if (open >= close) {
+					continue;
+				}
+				if (open == pending[1]) {
+					pending[1] = close;
+					continue;
+				}
+				if (pending[0] != INT64_MIN) {
+					pushinterval(L, pending[0], pending[1]);
+					lua_rawseti(L, -2, ++count);
+				}
+				pending[0] = open;
+				pending[1] = close;
+			}
+		}
+		from = next;
+	}
+	if (pending[0] != INT64_MIN) {
+		pushinterval(L, pending[0], pending[1]);
+		lua_rawseti(L, -2, ++count);
+	}
+	return 1;
+}
+
+
+/*
+ * tracing
+ */
+
+static int tz_trace_tostring (lua_State *L) {
+	struct tz_trace  *trace;
+
+	trace = luaL_checkudata(L, 1, TZ_TRACE);
+	lua_pushfstring(L, TZ_TRACE ": %p", trace);
+	return 1;
+}
+
+static int tz_trace_gc (lua_State *L) {
+	struct tz_trace  *trace;
+
+	trace = luaL_checkudata(L, 1, TZ_TRACE);
+	if (trace->f) {
+		fclose(trace->f);
+		trace->f = NULL;
+		TZ_TRACING_ADD(-1);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, trace->strings);
+	trace->strings = LUA_NOREF;
+	return 0;
+}
+
+static struct tz_trace *tz_trace_get (lua_State *L) {
+	struct tz_trace  *trace;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, TZ_TRACER);
+	trace = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return trace && trace->f ? trace : NULL;
+}
+
+static int tz_trace_string (lua_State *L, struct tz_trace *trace, const char *s, size_t len) {
+	int             id;
+	unsigned char   record[5];
+	uint16_t        value;
+
+	/* interned? */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, trace->strings);
+	lua_pushlstring(L, s, len);
+	lua_rawget(L, -2);
+	if (lua_type(L, -1) == LUA_TNUMBER) {
+		id = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+		return id;
+	}
+	lua_pop(L, 1);
+	if (trace->stringcnt > UINT16_MAX || len > UINT16_MAX) {
+		lua_pop(L, 1);
+		return -1;
+	}
+
+	/* intern */
+	id = trace->stringcnt++;
+	lua_pushlstring(L, s, len);
+	lua_pushinteger(L, id);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	record[0] = TZ_TRACE_STRING;
+	value = id;
+	memcpy(&record[1], &value, sizeof(value));
+	value = len;
+	memcpy(&record[3], &value, sizeof(value));
+	fwrite(record, sizeof(record), 1, trace->f);
+	fwrite(s, 1, len, trace->f);
+	return id;
+}
+
+static void tz_trace_call (lua_State *L, int kind, int64_t t, const char *timezone, size_t len,
+		const char *format, int32_t *fields) {
+	int               zone, fmt;
+	size_t            size;
+	uint16_t          value;
+	unsigned char     record[TZ_TRACE_RECORD_MAX];
+	struct tz_trace  *trace;
+
+	/* get trace and strings */
+	trace = tz_trace_get(L);
+	if (!trace) {
+		return;
+	}
+	zone = tz_trace_string(L, trace, timezone, len);
+	fmt = format ? tz_trace_string(L, trace, format, strlen(format)) : 0;
+	if (zone < 0 || fmt < 0) {
+		return;
+	}
+
+	/* write record */
+	record[0] = kind;
+	size = 1;
+	if (kind != TZ_TRACE_TIME) {
+		memcpy(&record[size], &t, sizeof(t));
+		size += sizeof(t);
+	}
+	value = zone;
+	memcpy(&record[size], &value, sizeof(value));
+	size += sizeof(value);
+	if (kind == TZ_TRACE_DATE) {
+		value = fmt;
+		memcpy(&record[size], &value, sizeof(value));
+		size += sizeof(value);
+	}
+	if (kind == TZ_TRACE_TIME) {
+		memcpy(&record[size], fields, TZ_TRACE_FIELDS * sizeof(int32_t));
+		size += TZ_TRACE_FIELDS * sizeof(int32_t);
+	}
+	fwrite(record, size, 1, trace->f);
+}
+
+static int tz_trace (lua_State *L) {
+	FILE             *f;
+	uint32_t          mark;
+	const char       *filename;
+	struct tz_trace  *trace;
+
+	/* stop current trace */
+	filename = luaL_optstring(L, 1, NULL);
+	lua_settop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, TZ_TRACER);
+	if (lua_touserdata(L, -1)) {
+		lua_pushcfunction(L, tz_trace_gc);
+		lua_insert(L, -2);
+		lua_call(L, 1, 0);
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, TZ_TRACER);
+	} else {
+		lua_pop(L, 1);
+	}
+	if (!filename) {
+		return 0;
+	}
+
+	/* start new trace */
+	trace = lua_newuserdata(L, sizeof(struct tz_trace));
+	memset(trace, 0, sizeof(struct tz_trace));
+	trace->strings = LUA_NOREF;
+	luaL_getmetatable(L, TZ_TRACE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	trace->strings = luaL_ref(L, LUA_REGISTRYINDEX);
+	f = fopen(filename, "wb");
+	if (!f) {
+		return luaL_error(L, "cannot open trace file '%s'", filename);
+	}
+	mark = TZ_TRACE_MARK;
+	if (fwrite(TZ_TRACE_MAGIC, 4, 1, f) != 1 || fputc(TZ_TRACE_VERSION, f) == EOF
+			|| fwrite(&mark, sizeof(mark), 1, f) != 1) {
+		fclose(f);
+		return luaL_error(L, "cannot write trace file '%s'", filename);
+	}
+	trace->f = f;
+	TZ_TRACING_ADD(1);
+	lua_setfield(L, LUA_REGISTRYINDEX, TZ_TRACER);
+	return 0;
+}
+
+
+/*
+ * images
+ */
+
+static const char *tz_image (const char *buffer, size_t size, struct tz_data *data,
+		const char **name, size_t *namelen) {
+	struct tz_image  image;
+
+	/* read and check image header */
+	if (size < sizeof(struct tz_image)) {
+		return "cannot read TZ image header";
+	}
+	memcpy(&image, buffer, sizeof(struct tz_image));
+	if (memcmp(image.magic, TZ_IMAGE_MAGIC, 4) != 0) {
+		return "TZ image magic mismatch";
+	}
+	if (image.version != TZ_IMAGE_VERSION || image.mark != TZ_IMAGE_MARK) {
+		return "unsupported TZ image version or byte order";
+	}
+	if (tz_checkheader(&image.header) || image.blocksize != tz_blocksize(&image.header)
+			|| size != sizeof(struct tz_image) + image.namelen + image.blocksize) {
+		return "malformed TZ image";
+	}
+	*name = buffer + sizeof(struct tz_image);
+	*namelen = image.namelen;
+
+	/* adopt block */
+	data->header = image.header;
+	tz_layout(data, malloc(image.blocksize));
+	if (!data->block) {
+		return "cannot allocate TZ data";
+	}
+	memcpy(data->block, buffer + sizeof(struct tz_image) + image.namelen, image.blocksize);
+	return tz_check(data);
+}
+
+static void tz_imageheader (struct tz_image *image, struct tz_data *data, size_t namelen) {
+	memset(image, 0, sizeof(struct tz_image));
+	memcpy(image->magic, TZ_IMAGE_MAGIC, 4);
+	image->version = TZ_IMAGE_VERSION;
+	image->namelen = namelen;
+	image->mark = TZ_IMAGE_MARK;
+	image->blocksize = tz_blocksize(&data->header);
+	image->header = data->header;
+}
+
+static int tz_bundlepath (lua_State *L, char *path, size_t size) {
+	const char  *dir;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, TZ_CACHEDIR);
+	dir = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	return dir && (size_t)snprintf(path, size, "%s/%s", dir, TZ_BUNDLE) < size;
+}
+
+static void tz_bundlestamp (struct tz_cachefile *stamp, struct stat *source) {
+	stamp->mtime = source->st_mtime;
+	stamp->size = source->st_size;
+	stamp->ino = source->st_ino;
+}
+
+static int tz_bundlecompare (const void *a, const void *b) {
+	return strcmp(((const struct tz_bundleitem *)a)->filename,
+			((const struct tz_bundleitem *)b)->filename);
+}
+
+static struct tz_bundle *tz_bundleget (const char *path) {
+	int                      fd;
+	void                    *map;
+	struct stat              buf;
+	struct tz_bundle        *bundle;
+	struct tz_bundleheader  *header;
+
+	/* find or add; called with the bundle mutex held */
+	for (bundle = tz_bundles; bundle; bundle = bundle->next) {
+		if (strcmp(bundle->path, path) == 0) {
+			break;
+		}
+	}
+	if (!bundle) {
+		bundle = calloc(1, sizeof(struct tz_bundle));
+		if (!bundle) {
+			return NULL;
+		}
+		snprintf(bundle->path, sizeof(bundle->path), "%s", path);
+		bundle->reopen = 1;
+		bundle->next = tz_bundles;
+		tz_bundles = bundle;
+	}
+	if (!bundle->reopen) {
+		return bundle;
+	}
+
+	/* map and check the header once; a missing or invalid bundle is not used */
+	bundle->reopen = 0;
+	bundle->map = NULL;
+	bundle->size = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return bundle;
+	}
+	map = MAP_FAILED;
+	if (fstat(fd, &buf) == 0 && buf.st_size >= (off_t)sizeof(struct tz_bundleheader)) {
+		map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		return bundle;
+	}
+	header = map;
+	if (memcmp(header->magic, TZ_BUNDLE_MAGIC, 4) != 0 || header->version != TZ_BUNDLE_VERSION
+			|| header->mark != TZ_BUNDLE_MARK || header->size != (uint64_t)buf.st_size
+			|| header->count > (buf.st_size - sizeof(struct tz_bundleheader))
+			/ sizeof(struct tz_bundleentry)) {
+		munmap(map, buf.st_size);
+		return bundle;
+	}
+	bundle->map = map;
+	bundle->size = buf.st_size;
+	return bundle;
+}
+
+static int tz_bundleentry (void *map, size_t size, const char *filename, struct stat *source,
+		struct tz_data *data) {
+	int                      i, cmp;
+	size_t                   lo, hi, mid;
+	struct tz_cachefile      stamp;
+	struct tz_bundleentry   *entries, *entry;
+	struct tz_bundleheader  *header;
+
+	/* binary search; 1 if found, fresh, and valid */
+	header = map;
+	entries = (struct tz_bundleentry *)(header + 1);
+	lo = 0;
+	hi = header->count;
+	entry = NULL;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strncmp(filename, entries[mid].filename, TZ_FILENAME_MAX);
+		if (cmp == 0) {
+			entry = &entries[mid];
+			break;
+		}
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	tz_bundlestamp(&stamp, source);
+	if (!entry || memcmp(&entry->source, &stamp, sizeof(stamp)) != 0
+			|| tz_checkheader(&entry->header) || (entry->offset & 7) != 0
+			|| entry->offset > size || tz_blocksize(&entry->header) > size - entry->offset) {
+		return 0;
+	}
+
+	/* use the block in place, checking it without writing */
+	memset(data, 0, sizeof(struct tz_data));
+	data->header = entry->header;
+	tz_layout(data, (char *)map + entry->offset);
+	for (i = 0; i < data->header.timecnt; i++) {
+		if (data->timetypes[i] >= data->header.typecnt) {
+			return 0;
+		}
+	}
+	for (i = 0; i < data->header.typecnt; i++) {
+		if (data->types[i].abbrind > data->header.charcnt) {
+			return 0;
+		}
+	}
+	if (data->chars[data->header.charcnt] != '\0'
+			|| data->footer[data->header.footercnt] != '\0') {
+		return 0;
+	}
+	data->mapped = 1;
+	tz_strategy(data);
+	return 1;
+}
+
+static int tz_bundlefind (const char *path, const char *filename, struct stat *source,
+		struct tz_data *data) {
+	int                result;
+	struct tz_bundle  *bundle;
+
+	/* a missing or stale entry has the caller parse the TZ file */
+	pthread_mutex_lock(&tz_bundle_mutex);
+	bundle = tz_bundleget(path);
+	result = bundle && bundle->map
+			&& tz_bundleentry(bundle->map, bundle->size, filename, source, data);
+	pthread_mutex_unlock(&tz_bundle_mutex);
+	if (!result) {
+		memset(data, 0, sizeof(struct tz_data));
+	}
+	return result;
+}
+
+static void tz_bundlenote (const char *path, const char *filename, struct stat *source,
+		struct tz_data *data) {
+	size_t                 i, blocksize;
+	void                  *block;
+	struct tz_bundle      *bundle;
+	struct tz_bundleitem  *item;
+
+	/* keep a copy of the parsed data for the next write of the bundle */
+	blocksize = tz_blocksize(&data->header);
+	block = malloc(blocksize);
+	if (!block) {
+		return;
+	}
+	memcpy(block, data->block, blocksize);
+	pthread_mutex_lock(&tz_bundle_mutex);
+	bundle = tz_bundleget(path);
+	item = NULL;
+	if (bundle) {
+		for (i = 0; i < bundle->itemcnt; i++) {
+			if (strcmp(bundle->items[i].filename, filename) == 0) {
+				item = &bundle->items[i];
+				free(item->data.block);
+				break;
+			}
+		}
+		if (!item && bundle->itemcnt == bundle->itemalloc) {
+			item = realloc(bundle->items, (bundle->itemalloc ? bundle->itemalloc * 2 : 16)
+					* sizeof(struct tz_bundleitem));
+			if (item) {
+				bundle->items = item;
+				bundle->itemalloc = bundle->itemalloc ? bundle->itemalloc * 2 : 16;
+			}
+			item = NULL;
+		}
+		if (!item && bundle->itemcnt < bundle->itemalloc) {
+			item = &bundle->items[bundle->itemcnt++];
+		}
+	}
+	if (item) {
+		memset(item, 0, sizeof(struct tz_bundleitem));
+		snprintf(item->filename, sizeof(item->filename), "%s", filename);
+		tz_bundlestamp(&item->source, source);
+		item->data.header = data->header;
+		tz_layout(&item->data, block);
+		block = NULL;
+	}
+	pthread_mutex_unlock(&tz_bundle_mutex);
+	free(block);
+}
+
+static int tz_bundlewrite (const char *path) {
+	int                     fd, ok;
+	char                    temp[PATH_MAX];
+	void                   *map, *p;
+	size_t                  i, j, cnt, alloc, count, size, offset, blocksize;
+	struct stat             buf;
+	struct tz_bundle       *bundle;
+	struct tz_bundleitem   *items, *item;
+	struct tz_bundleentry  *entries, entry;
+	struct tz_bundleheader  header;
+	static const char       padding[8];
+
+	/* take the zones parsed since the last write; mappings stay valid without the mutex */
+	pthread_mutex_lock(&tz_bundle_mutex);
+	bundle = tz_bundleget(path);
+	if (!bundle || bundle->itemcnt == 0) {
+		pthread_mutex_unlock(&tz_bundle_mutex);
+		return 0;
+	}
+	items = bundle->items;
+	cnt = bundle->itemcnt;
+	alloc = bundle->itemalloc;
+	bundle->items = NULL;
+	bundle->itemcnt = bundle->itemalloc = 0;
+	map = bundle->map;
+	size = bundle->size;
+	pthread_mutex_unlock(&tz_bundle_mutex);
+
+	/* keep the entries of the current bundle whose TZ files are unchanged */
+	count = map ? ((struct tz_bundleheader *)map)->count : 0;
+	entries = map ? (struct tz_bundleentry *)((struct tz_bundleheader *)map + 1) : NULL;
+	for (i = 0; i < count; i++) {
+		if (!memchr(entries[i].filename, '\0', TZ_FILENAME_MAX)) {
+			continue;
+		}
+		for (j = 0; j < cnt && strcmp(items[j].filename, entries[i].filename) != 0; j++);
+		if (j < cnt || stat(entries[i].filename, &buf) != 0) {
+			continue;
+		}
+		if (cnt == alloc) {
+			p = realloc(items, (alloc ? alloc * 2 : 16) * sizeof(struct tz_bundleitem));
+			if (!p) {
+				break;
+			}
+			items = p;
+			alloc = alloc ? alloc * 2 : 16;
+		}
+		item = &items[cnt];
+		memset(item, 0, sizeof(struct tz_bundleitem));
+		if (tz_bundleentry(map, size, entries[i].filename, &buf, &item->data)) {
+			memcpy(item->filename, entries[i].filename, sizeof(item->filename));
+			item->source = entries[i].source;
+			cnt++;
+		}
+	}
+	qsort(items, cnt, sizeof(struct tz_bundleitem), tz_bundlecompare);
+
+	/* write atomically; the cache is best effort */
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TZ_BUNDLE_MAGIC, 4);
+	header.version = TZ_BUNDLE_VERSION;
+	header.mark = TZ_BUNDLE_MARK;
+	header.count = cnt;
+	offset = sizeof(header) + cnt * sizeof(struct tz_bundleentry);
+	for (i = 0; i < cnt; i++) {
+		offset += (tz_blocksize(&items[i].data.header) + 7) & ~(size_t)7;
+	}
+	header.size = offset;
+	ok = (size_t)snprintf(temp, sizeof(temp), "%s.XXXXXX", path) < sizeof(temp)
+			&& (fd = mkstemp(temp)) >= 0;
+	if (ok) {
+		ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+		offset = sizeof(header) + cnt * sizeof(struct tz_bundleentry);
+		for (i = 0; ok && i < cnt; i++) {
+			item = &items[i];
+			memset(&entry, 0, sizeof(entry));
+			memcpy(entry.filename, item->filename, sizeof(entry.filename));
+			entry.source = item->source;
+			entry.offset = offset;
+			entry.header = item->data.header;
+			ok = write(fd, &entry, sizeof(entry)) == (ssize_t)sizeof(entry);
+			offset += (tz_blocksize(&item->data.header) + 7) & ~(size_t)7;
+		}
+		for (i = 0; ok && i < cnt; i++) {
+			item = &items[i];
+			blocksize = tz_blocksize(&item->data.header);
+			ok = write(fd, item->data.block, blocksize) == (ssize_t)blocksize
+					&& write(fd, padding, -blocksize & 7) == (ssize_t)(-blocksize & 7);
+		}
+		ok = ok && fchmod(fd, 0644) == 0;
+		if (close(fd) != 0 || !ok || rename(temp, path) != 0) {
+			unlink(temp);
+			ok = 0;
+		}
+	}
+
+	/* free, and map the new bundle on next use */
+	for (i = 0; i < cnt; i++) {
+		if (!items[i].data.mapped) {
+			free(items[i].data.block);
+		}
+	}
+	free(items);
+	pthread_mutex_lock(&tz_bundle_mutex);
+	bundle->reopen = 1;
+	pthread_mutex_unlock(&tz_bundle_mutex);
+	return ok ? (int)cnt : 0;
+}
+
+static int tz_writer_gc (lua_State *L) {
+	char  path[PATH_MAX];
+
+	/* write the zones parsed since the last write as the state closes */
+	if (tz_bundlepath(L, path, sizeof(path))) {
+		tz_bundlewrite(path);
+	}
+	return 0;
+}
+
+static int tz_dump (lua_State *L) {
+	size_t            len;
+	const char       *timezone;
+	luaL_Buffer       b;
+	struct tz_data   *data;
+	struct tz_image   image;
+
+	/* check arguments */
+	timezone = luaL_optlstring(L, 1, TZ_LOCALTIME, &len);
+	luaL_argcheck(L, len <= UINT8_MAX, 1, "timezone too long");
+	data = tz_data(L, timezone, len);
+
+	/* build image */
+	tz_imageheader(&image, data, len);
+	luaL_buffinit(L, &b);
+	luaL_addlstring(&b, (const char *)&image, sizeof(image));
+	luaL_addlstring(&b, timezone, len);
+	luaL_addlstring(&b, data->block, image.blocksize);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+static int tz_cachedir (lua_State *L) {
+	int                n;
+	char               path[PATH_MAX];
+	const char        *dir;
+	struct tz_bundle  *bundle;
+
+	/* check arguments */
+	n = lua_gettop(L);
+	dir = n > 0 && lua_toboolean(L, 1) ? luaL_checkstring(L, 1) : NULL;
+
+	/* return previous directory, writing its bundle, and set new directory; its bundle is
+	 * mapped again */
+	if (n > 0 && tz_bundlepath(L, path, sizeof(path))) {
+		tz_bundlewrite(path);
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, TZ_CACHEDIR);
+	if (n > 0) {
+		if (dir) {
+			mkdir(dir, 0755);
+			if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, TZ_BUNDLE)
+					< sizeof(path)) {
+				pthread_mutex_lock(&tz_bundle_mutex);
+				for (bundle = tz_bundles; bundle; bundle = bundle->next) {
+					if (strcmp(bundle->path, path) == 0) {
+						bundle->reopen = 1;
+					}
+				}
+				pthread_mutex_unlock(&tz_bundle_mutex);
+			}
+			lua_pushvalue(L, 1);
+		} else {
+			lua_pushnil(L);
+		}
+		lua_setfield(L, LUA_REGISTRYINDEX, TZ_CACHEDIR);
+	}
+	return 1;
+}
+
+static int tz_cachewrite (lua_State *L) {
+	char  path[PATH_MAX];
+
+	if (!tz_bundlepath(L, path, sizeof(path))) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, tz_bundlewrite(path));
+	return 1;
+}
+
+static int tz_zone_from_tzif (lua_State *L) {
+	size_t           size;
+	const char      *buffer, *error;
+	struct tz_data  *data;
+
+	/* check arguments */
+	luaL_checkstring(L, 1);
+	buffer = luaL_checklstring(L, 2, &size);
+
+	/* allocate userdata */
+	data = lua_newuserdata(L, sizeof(struct tz_data));
+	memset(data, 0, sizeof(struct tz_data));
+	luaL_getmetatable(L, TZ_DATA);
+	lua_setmetatable(L, -2);
+
+	/* parse */
+	if ((error = tz_parse(buffer, size, data))) {
+		return luaL_error(L, "%s", error);
+	}
+
+	/* cache */
+	tz_cache(L);
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, -3);
+	lua_settable(L, -3);
+	return 0;
+}
+
+static int tz_load_image (lua_State *L) {
+	size_t           size, len, namelen;
+	const char      *buffer, *timezone, *name, *error;
+	struct tz_data  *data;
+
+	/* check arguments */
+	buffer = luaL_checklstring(L, 1, &size);
+	timezone = luaL_optlstring(L, 2, NULL, &len);
+
+	/* allocate userdata */
+	data = lua_newuserdata(L, sizeof(struct tz_data));
+	memset(data, 0, sizeof(struct tz_data));
+	luaL_getmetatable(L, TZ_DATA);
+	lua_setmetatable(L, -2);
+
+	/* adopt image */
+	if ((error = tz_image(buffer, size, data, &name, &namelen))) {
+		return luaL_error(L, "%s", error);
+	}
+	if (!timezone) {
+		timezone = name;
+		len = namelen;
+	}
+
+	/* cache */
+	tz_cache(L);
+	lua_pushlstring(L, timezone, len);
+	lua_pushvalue(L, -3);
+	lua_settable(L, -3);
+	lua_pushlstring(L, timezone, len);
+	return 1;
+}
+
+
+static int tz_fixedfooter (char *footer, size_t size, struct tz_type *type, const char *abbr) {
+	int      quote, n;
+	int32_t  off;
+	size_t   i, len;
+
+	/* abbreviation, quoted unless alphabetic; an empty footer if it cannot be represented */
+	len = strlen(abbr);
+	quote = 0;
+	for (i = 0; i < len; i++) {
+		if (!isalpha((unsigned char)abbr[i])) {
+			if (!isalnum((unsigned char)abbr[i]) && abbr[i] != '+' && abbr[i] != '-') {
+				return 0;
+			}
+			quote = 1;
+		}
+	}
+	if (len < 3 || len + 16 > size) {
+		return 0;
+	}
+
+	/* POSIX offsets are west of UTC */
+	off = -type->gmtoff;
+	n = snprintf(footer, size, quote ? "<%s>%s%d" : "%s%s%d", abbr, off < 0 ? "-" : "",
+			abs(off) / 3600);
+	if (abs(off) % 3600 != 0) {
+		n += snprintf(footer + n, size - n, ":%02d", abs(off) / 60 % 60);
+		if (abs(off) % 60 != 0) {
+			n += snprintf(footer + n, size - n, ":%02d", abs(off) % 60);
+		}
+	}
+	return n;
+}
+
+static void tz_subset (lua_State *L, struct tz_data *data, int64_t from, int64_t to) {
+	int               i, j, lo, hi, initial, last, typemap[256];
+	char              fixed[TZ_FOOTER_FIXED];
+	size_t            len;
+	const char       *abbr, *footer;
+	struct tz_data   *subset;
+	struct tz_header  header;
+
+	/* transitions after from and up to to; the type in effect at from comes first */
+	lo = tz_index(data, from) + 1;
+	initial = lo > 0 ? data->timetypes[lo - 1] : 0;
+	hi = tz_index(data, to) + 1;
+	if (hi < lo) {
+		hi = lo;
+	}
+	for (i = 0; i < data->header.typecnt; i++) {
+		typemap[i] = -1;
+	}
+	memset(&header, 0, sizeof(struct tz_header));
+	memcpy(header.magic, "TZif", 4);
+	header.version = '2';
+	header.timecnt = hi - lo;
+
+	/* the footer rule applies after the last transition; truncated data keeps the type at to */
+	if (hi == data->header.timecnt) {
+		footer = data->footer;
+		header.footercnt = data->header.footercnt;
+		if (data->header.version == '3') {
+			header.version = '3';
+		}
+	} else {
+		last = hi > lo ? data->timetypes[hi - 1] : initial;
+		footer = fixed;
+		header.footercnt = tz_fixedfooter(fixed, sizeof(fixed), &data->types[last],
+				&data->chars[data->types[last].abbrind]);
+	}
+	typemap[initial] = header.typecnt++;
+	for (i = lo; i < hi; i++) {
+		if (typemap[data->timetypes[i]] < 0) {
+			typemap[data->timetypes[i]] = header.typecnt++;
+		}
+	}
+	for (i = 0; i < data->header.typecnt; i++) {
+		if (typemap[i] >= 0) {
+			header.charcnt += strlen(&data->chars[data->types[i].abbrind]) + 1;  /* bound */
+		}
+	}
+
+	/* allocate userdata */
+	subset = lua_newuserdata(L, sizeof(struct tz_data));
+	memset(subset, 0, sizeof(struct tz_data));
+	luaL_getmetatable(L, TZ_DATA);
+	lua_setmetatable(L, -2);
+	subset->header = header;
+	tz_layout(subset, calloc(1, tz_blocksize(&header)));
+	if (!subset->block) {
+		luaL_error(L, "cannot allocate TZ data");
+	}
+
+	/* copy transitions and used types; abbreviations are shared, including suffixes */
+	for (i = lo; i < hi; i++) {
+		subset->timevalues[i - lo] = data->timevalues[i];
+		subset->timetypes[i - lo] = typemap[data->timetypes[i]];
+	}
+
+	header.charcnt = 0;
+	for (i = 0; i < data->header.typecnt; i++) {
+		if (typemap[i] < 0) {
+			continue;
+		}
+		subset->types[typemap[i]] = data->types[i];
+		abbr = &data->chars[data->types[i].abbrind];
+		len = strlen(abbr) + 1;
+		for (j = 0; j + (int)len <= header.charcnt; j++) {
+			if (memcmp(&subset->chars[j], abbr, len) == 0) {
+				break;
+			}
+		}
+		if (j + (int)len > header.charcnt) {
+			if (header.charcnt > UINT8_MAX) {
+				luaL_error(L, "too many TZ abbreviations");
+			}
+			memcpy(&subset->chars[header.charcnt], abbr, len);
+			j = header.charcnt;
+			header.charcnt += len;
+		}
+		subset->types[typemap[i]].abbrind = j;
+	}
+	subset->header.charcnt = header.charcnt;  /* the block keeps its bound size */
+	tz_layout(subset, subset->block);
+	subset->chars[header.charcnt] = '\0';
+	memcpy(subset->footer, footer, header.footercnt);
+	subset->footer[header.footercnt] = '\0';
+}
+
+static void tz_addbe (luaL_Buffer *b, uint64_t value, size_t size) {
+	uint32_t  value32;
+
+	if (size == sizeof(uint64_t)) {
+		value = htobe64(value);
+		luaL_addlstring(b, (const char *)&value, sizeof(value));
+	} else {
+		value32 = htobe32((uint32_t)value);
+		luaL_addlstring(b, (const char *)&value32, sizeof(value32));
+	}
+}
+
+static void tz_tzif (lua_State *L, struct tz_data *data) {
+	int               i, v;
+	luaL_Buffer       b;
+	struct tz_header  header;
+
+	/* minimal version 1 block, then the version 2 block with 64-bit times, and the footer */
+	luaL_buffinit(L, &b);
+	for (v = 1; v <= 2; v++) {
+		memset(&header, 0, sizeof(struct tz_header));
+		memcpy(header.magic, "TZif", 4);
+		header.version = data->header.version == '3' ? '3' : '2';
+		luaL_addlstring(&b, (const char *)&header, offsetof(struct tz_header, isgmtcnt));
+		tz_addbe(&b, 0, sizeof(int32_t));  /* isutcnt */
+		tz_addbe(&b, 0, sizeof(int32_t));  /* isstdcnt */
+		tz_addbe(&b, 0, sizeof(int32_t));  /* leapcnt */
+		tz_addbe(&b, v == 1 ? 0 : data->header.timecnt, sizeof(int32_t));
+		tz_addbe(&b, v == 1 ? 1 : data->header.typecnt, sizeof(int32_t));
+		tz_addbe(&b, v == 1 ? 1 : data->header.charcnt, sizeof(int32_t));
+		if (v == 1) {
+			luaL_addlstring(&b, "\0\0\0\0\0\0\0", TZ_TYPE_PACKED + 1);
+			continue;
+		}
+		for (i = 0; i < data->header.timecnt; i++) {
+			tz_addbe(&b, (uint64_t)data->timevalues[i], sizeof(int64_t));
+		}
+		luaL_addlstring(&b, (const char *)data->timetypes, data->header.timecnt);
+		for (i = 0; i < data->header.typecnt; i++) {
+			tz_addbe(&b, (uint32_t)data->types[i].gmtoff, sizeof(int32_t));
+			luaL_addchar(&b, data->types[i].isdst);
+			luaL_addchar(&b, data->types[i].abbrind);
+		}
+		luaL_addlstring(&b, data->chars, data->header.charcnt);
+	}
+	luaL_addchar(&b, '\n');
+	luaL_addlstring(&b, data->footer, data->header.footercnt);
+	luaL_addchar(&b, '\n');
+	luaL_pushresult(&b);
+}
+
+static void tz_exportdata (lua_State *L, const char *timezone, size_t len, int format,
+		int64_t from, int64_t to) {
+	luaL_Buffer      b;
+	struct tz_data  *data;
+	struct tz_image  image;
+
+	/* subset, then TZif or image; leaves the result on the stack */
+	data = tz_data(L, timezone, len);
+	tz_subset(L, data, from, to);
+	data = lua_touserdata(L, -1);
+	if (format == 0) {
+		tz_tzif(L, data);
+	} else {
+		if (len > UINT8_MAX) {
+			luaL_error(L, "timezone too long");
+		}
+		tz_imageheader(&image, data, len);
+		luaL_buffinit(L, &b);
+		luaL_addlstring(&b, (const char *)&image, sizeof(image));
+		luaL_addlstring(&b, timezone, len);
+		luaL_addlstring(&b, data->block, image.blocksize);
+		luaL_pushresult(&b);
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+static void tz_exportargs (lua_State *L, int index, int *format, int64_t *from, int64_t *to) {
+	static const char *const formats[] = { "tzif", "image", NULL };
+
+	*format = luaL_checkoption(L, index, "tzif", formats);
+	*from = lua_isnoneornil(L, index + 1) ? INT64_MIN : checktime(L, index + 1);
+	*to = lua_isnoneornil(L, index + 2) ? INT64_MAX : checktime(L, index + 2);
+	luaL_argcheck(L, *from <= *to, index + 2, "end precedes start");
+}
+
+static int tz_exportpath (const char *dir, const char *name, char *path, size_t size,
+		int create) {
+	size_t  pos;
+
+	/* relative names without empty, '.', or '..' components; optionally creates parents */
+	if (*name == '\0' || *name == '/' || strstr(name, "//") || name[strlen(name) - 1] == '/') {
+		return 0;
+	}
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strncmp(name, "./", 2) == 0
+			|| strncmp(name, "../", 3) == 0 || strstr(name, "/./") || strstr(name, "/../")
+			|| (strlen(name) >= 2 && strcmp(&name[strlen(name) - 2], "/.") == 0)
+			|| (strlen(name) >= 3 && strcmp(&name[strlen(name) - 3], "/..") == 0)) {
+		return 0;
+	}
+	if ((size_t)snprintf(path, size, "%s/%s", dir, name) >= size) {
+		return 0;
+	}
+	for (pos = strlen(dir) + 1; create && path[pos]; pos++) {
+		if (path[pos] == '/') {
+			path[pos] = '\0';
+			mkdir(path, 0755);
+			path[pos] = '/';
+		}
+	}
+	return 1;
+}
+
+static int tz_export (lua_State *L) {
+	int          format;
+	size_t       len;
+	int64_t      from, to;
+	const char  *timezone;
+
+	/* check arguments */
+	timezone = luaL_optlstring(L, 1, TZ_LOCALTIME, &len);
+	tz_exportargs(L, 2, &format, &from, &to);
+
+	/* export */
+	tz_exportdata(L, timezone, len, format, from, to);
+	return 1;
+}
+
+static int tz_exportlinks (lua_State *L, const char *dir, int n, int create) {
+	int          i, count, depth, found;
+	char         path[PATH_MAX], target[PATH_MAX];
+	size_t       pos;
+	const char  *link, *timezone, *p;
+
+	/* relative symbolic links to exported zones; checks only unless create is set */
+	count = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			lua_pop(L, 1);
+			continue;
+		}
+		link = lua_tostring(L, -2);
+		timezone = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+		found = 0;
+		for (i = 1; timezone && i <= n && !found; i++) {
+			lua_rawgeti(L, 2, i);
+			found = lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), timezone) == 0;
+			lua_pop(L, 1);
+		}
+		if (!found) {
+			return luaL_error(L, "link target of '%s' is not exported", link);
+		}
+		depth = 0;
+		for (p = link; *p; p++) {
+			depth += *p == '/';
+		}
+		pos = 0;
+		while (depth-- > 0 && pos + 3 < sizeof(target)) {
+			memcpy(&target[pos], "../", 3);
+			pos += 3;
+		}
+		if (!tz_exportpath(dir, link, path, sizeof(path), create)
+				|| (size_t)snprintf(&target[pos], sizeof(target) - pos, "%s", timezone)
+				>= sizeof(target) - pos) {
+			return luaL_error(L, "invalid export name '%s'", link);
+		}
+		if (create) {
+			unlink(path);
+			if (symlink(target, path) != 0) {
+				return luaL_error(L, "cannot link TZ file '%s'", path);
+			}
+		}
+		count++;
+		lua_pop(L, 1);
+	}
+	return count;
+}
+
+static int tz_exportdir (lua_State *L) {
+	int          i, n, fd, ok, format;
+	char         path[PATH_MAX], temp[PATH_MAX];
+	size_t       len, size;
+	int64_t      from, to;
+	const char  *dir, *timezone, *buffer;
+
+	/* check arguments */
+	dir = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	tz_exportargs(L, 3, &format, &from, &to);
+	lua_settop(L, 5);
+	n = (int)lua_rawlen(L, 2);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 2, i);
+		timezone = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+		if (!timezone) {
+			return luaL_error(L, "element %d is not a time zone", i);
+		}
+		if (!tz_exportpath(dir, timezone, path, sizeof(path), 0)) {
+			return luaL_error(L, "invalid export name '%s'", timezone);
+		}
+		lua_pop(L, 1);
+	}
+	tz_exportlinks(L, dir, n, 0);
+
+	/* zones */
+	mkdir(dir, 0755);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 2, i);
+		timezone = lua_tolstring(L, -1, &len);
+		if (!tz_exportpath(dir, timezone, path, sizeof(path), 1)
+				|| (size_t)snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= sizeof(temp)) {
+			return luaL_error(L, "invalid export name '%s'", timezone);
+		}
+		tz_exportdata(L, timezone, len, format, from, to);
+		buffer = lua_tolstring(L, -1, &size);
+		fd = mkstemp(temp);
+		if (fd < 0) {
+			return luaL_error(L, "cannot write TZ file '%s'", path);
+		}
+		ok = write(fd, buffer, size) == (ssize_t)size && fchmod(fd, 0644) == 0;
+		if (close(fd) != 0 || !ok || rename(temp, path) != 0) {
+			unlink(temp);
+			return luaL_error(L, "cannot write TZ file '%s'", path);
+		}
+		lua_pop(L, 2);
+	}
+
+	/* links */
+	lua_pushinteger(L, n + tz_exportlinks(L, dir, n, 1));
+	return 1;
+}
+
+
+/*
+ * asynchronous loading
+ */
+
+static void tz_pin (void) {
+	Dl_info  info;
+
+	/* keep the module loaded for the life of the process, as detached jobs run its code */
+	if (dladdr((void *)tz_pin, &info) && info.dli_fname
+			&& dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE)) {
+		tz_pinned = 1;
+	}
+}
+
+static void *tz_job_run (void *arg) {
+	int             detached;
+	struct stat     buf;
+	struct tz_job  *job;
+
+	/* load */
+	job = arg;
+	if (stat(job->filename, &buf) != 0 || !S_ISREG(buf.st_mode)) {
+		snprintf(job->error, sizeof(job->error), "unknown timezone '%s'", job->timezone);
+		job->failed = 1;
+	} else if (!job->bundle[0] || !tz_bundlefind(job->bundle, job->filename, &buf,
+			&job->data)) {
+		job->failed = tz_load(job->filename, &job->data, job->error, sizeof(job->error)) != 0;
+		if (!job->failed && job->bundle[0]) {
+			tz_bundlenote(job->bundle, job->filename, &buf, &job->data);
+		}
+	}
+
+	/* signal, or free the job if all loaders have gone */
+	pthread_mutex_lock(&tz_mutex);
+	job->done = 1;
+	detached = job->detached;
+	pthread_mutex_unlock(&tz_mutex);
+	if (detached) {
+		tz_job_free(job);
+		return NULL;
+	}
+	while (write(job->fds[1], "", 1) < 0 && errno == EINTR);
+	return NULL;
+}
+
+static void tz_job_free (struct tz_job *job) {
+	close(job->fds[0]);
+	close(job->fds[1]);
+	if (!job->data.mapped) {
+		free(job->data.block);
+	}
+	free(job);
+}
+
+static struct tz_job *tz_job_acquire (const char *timezone, const char *filename,
+		const char *bundle) {
+	struct tz_job  *job;
+
+	/* join a pending or completed job for the same file */
+	pthread_mutex_lock(&tz_mutex);
+	for (job = tz_jobs; job; job = job->next) {
+		if (strcmp(job->filename, filename) == 0) {
+			job->refs++;
+			pthread_mutex_unlock(&tz_mutex);
+			return job;
+		}
+	}
+
+	/* start a new job */
+	job = calloc(1, sizeof(struct tz_job));
+	if (!job) {
+		pthread_mutex_unlock(&tz_mutex);
+		return NULL;
+	}
+	snprintf(job->timezone, sizeof(job->timezone), "%s", timezone);
+	snprintf(job->filename, sizeof(job->filename), "%s", filename);
+	snprintf(job->bundle, sizeof(job->bundle), "%s", bundle ? bundle : "");
+	job->refs = 1;
+	pthread_once(&tz_pin_once, tz_pin);
+	if (pipe(job->fds) != 0) {
+		pthread_mutex_unlock(&tz_mutex);
+		free(job);
+		return NULL;
+	}
+	if (pthread_create(&job->thread, NULL, tz_job_run, job) != 0) {
+		pthread_mutex_unlock(&tz_mutex);
+		close(job->fds[0]);
+		close(job->fds[1]);
+		free(job);
+		return NULL;
+	}
+	job->next = tz_jobs;
+	tz_jobs = job;
+	pthread_mutex_unlock(&tz_mutex);
+	return job;
+}
+
+static void tz_job_release (struct tz_job *job) {
+	pthread_t        thread;
+	struct tz_job  **p;
+
+	/* unlink the job when the last reference goes */
+	pthread_mutex_lock(&tz_mutex);
+	if (--job->refs > 0) {
+		pthread_mutex_unlock(&tz_mutex);
+		return;
+	}
+	for (p = &tz_jobs; *p != job; p = &(*p)->next);
+	*p = job->next;
+
+	/* a pending job is detached and frees itself, so collection does not wait for the parse;
+	 * this requires the module to be pinned, as the thread outlives the state */
+	if (!job->done && tz_pinned) {
+		job->detached = 1;
+		thread = job->thread;
+		pthread_mutex_unlock(&tz_mutex);
+		pthread_detach(thread);
+		return;
+	}
+	pthread_mutex_unlock(&tz_mutex);
+
+	/* otherwise, join the thread and free */
+	pthread_join(job->thread, NULL);
+	tz_job_free(job);
+}
+
+static int tz_loader_tostring (lua_State *L) {
+	struct tz_loader  *loader;
+
+	loader = luaL_checkudata(L, 1, TZ_LOADER);
+	lua_pushfstring(L, TZ_LOADER ": %p", loader);
+	return 1;
+}
+
+static int tz_loader_gc (lua_State *L) {
+	struct tz_loader  *loader;
+
+	loader = luaL_checkudata(L, 1, TZ_LOADER);
+	if (loader->job) {
+		tz_job_release(loader->job);
+		loader->job = NULL;
+	}
+	return 0;
+}
+
+static int tz_loader_adopt (lua_State *L, struct tz_loader *loader) {
+	int              done;
+	char             error[256];
+	struct tz_job   *job;
+	struct tz_data  *data;
+
+	/* check job */
+	job = loader->job;
+	if (!job) {
+		return 1;
+	}
+	pthread_mutex_lock(&tz_mutex);
+	done = job->done;
+	pthread_mutex_unlock(&tz_mutex);
+	if (!done) {
+		return 0;
+	}
+
+	/* forget the loader */
+	lua_getfield(L, LUA_REGISTRYINDEX, TZ_LOADERS);
+	lua_pushnil(L);
+	lua_setfield(L, -2, loader->timezone);
+	lua_pop(L, 1);
+
+	/* failed? */
+	if (job->failed) {
+		snprintf(error, sizeof(error), "%s", job->error);
+		loader->job = NULL;
+		tz_job_release(job);
+		return luaL_error(L, "%s", error);
+	}
+
+	/* cache a copy of the data, unless the time zone has been loaded meanwhile */
+	tz_cache(L);
+	lua_getfield(L, -1, loader->timezone);
+	if (!luaL_testudata(L, -1, TZ_DATA)) {
+		lua_pop(L, 1);
+		data = lua_newuserdata(L, sizeof(struct tz_data));
+		memset(data, 0, sizeof(struct tz_data));
+		luaL_getmetatable(L, TZ_DATA);
+		lua_setmetatable(L, -2);
+		data->header = job->data.header;
+		if (job->data.mapped) {
+			tz_layout(data, job->data.block);
+			data->mapped = 1;
+		} else {
+			tz_layout(data, malloc(tz_blocksize(&data->header)));
+			if (!data->block) {
+				return luaL_error(L, "cannot allocate TZ data");
+			}
+			memcpy(data->block, job->data.block, tz_blocksize(&data->header));
+		}
+		tz_strategy(data);
+		lua_setfield(L, -2, loader->timezone);
+	} else {
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	loader->job = NULL;
+	tz_job_release(job);
+	return 1;
+}
+
+static int tz_loader_fd (lua_State *L) {
+	struct tz_loader  *loader;
+
+	loader = luaL_checkudata(L, 1, TZ_LOADER);
+	if (loader->job) {
+		lua_pushinteger(L, loader->job->fds[0]);
+	} else {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int tz_loader_ready (lua_State *L) {
+	struct tz_loader  *loader;
+
+	loader = luaL_checkudata(L, 1, TZ_LOADER);
+	lua_pushboolean(L, tz_loader_adopt(L, loader));
+	return 1;
+}
+
+static int tz_async (lua_State *L) {
+	size_t             len;
+	char               filename[TZ_FILENAME_MAX], path[PATH_MAX];
+	const char        *timezone;
+	struct tz_loader  *loader;
+
+	/* check arguments */
+	timezone = luaL_optlstring(L, 1, TZ_LOCALTIME, &len);
+	tz_filename(L, timezone, len, filename);
+
+	/* coalesce with a pending loader of this state */
+	lua_getfield(L, LUA_REGISTRYINDEX, TZ_LOADERS);
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, TZ_LOADERS);
+	}
+	lua_getfield(L, -1, timezone);
+	if (luaL_testudata(L, -1, TZ_LOADER)) {
+		return 1;
+	}
+	lua_pop(L, 1);
+
+	/* make loader */
+	loader = lua_newuserdata(L, sizeof(struct tz_loader));
+	memset(loader, 0, sizeof(struct tz_loader));
+	memcpy(loader->timezone, timezone, len + 1);
+	luaL_getmetatable(L, TZ_LOADER);
+	lua_setmetatable(L, -2);
+
+	/* cached? */
+	tz_cache(L);
+	lua_getfield(L, -1, timezone);
+	if (luaL_testudata(L, -1, TZ_DATA)) {
+		lua_pop(L, 2);
+		return 1;
+	}
+	lua_pop(L, 2);
+
+	/* start or join job */
+	loader->job = tz_job_acquire(timezone, filename,
+			tz_bundlepath(L, path, sizeof(path)) ? path : NULL);
+	if (!loader->job) {
+		return luaL_error(L, "cannot start loading timezone '%s'", timezone);
+	}
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, timezone);
+	return 1;
+}
+
+#if LUA_VERSION_NUM >= 503
+static int tz_await_continue (lua_State *L, int status, lua_KContext ctx) {
+	struct pollfd      fd;
+	struct tz_loader  *loader;
+
+	(void)status;
+	(void)ctx;
+	loader = luaL_checkudata(L, 2, TZ_LOADER);
+	while (!tz_loader_adopt(L, loader)) {
+		if (lua_isyieldable(L)) {
+			/* yield the loader; resume when its descriptor is readable */
+			lua_pushvalue(L, 2);
+			return lua_yieldk(L, 1, 0, tz_await_continue);
+		}
+		fd.fd = loader->job->fds[0];
+		fd.events = POLLIN;
+		poll(&fd, 1, -1);
+	}
+	return 0;
+}
+
+static int tz_await (lua_State *L) {
+	lua_settop(L, 1);
+	tz_async(L);
+	lua_replace(L, 2);
+	lua_settop(L, 2);
+	return tz_await_continue(L, LUA_OK, 0);
+}
+#endif
+
+
+/*
+ * schedule
+ */
+
+static int tz_schedule_tostring (lua_State *L) {
+	struct tz_schedule  *schedule;
+
+	schedule = luaL_checkudata(L, 1, TZ_SCHEDULE);
+	lua_pushfstring(L, TZ_SCHEDULE ": %p", schedule);
+	return 1;
+}
+
+static int tz_schedule_gc (lua_State *L) {
+	struct tz_schedule  *schedule;
+
+	schedule = luaL_checkudata(L, 1, TZ_SCHEDULE);
+	luaL_unref(L, LUA_REGISTRYINDEX, schedule->ref);
+	free(schedule->week);
+	free(schedule->exceptions);
+	free(schedule->spans);
+	free(schedule->cache);
+	return 0;
+}
+
+static int tz_schedule_spans (lua_State *L, int index, int32_t *spans, int32_t base) {
+	int  i, n, open, close;
+
+	n = lua_rawlen(L, index);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, index, i);
+		if (!lua_istable(L, -1)) {
+			return luaL_error(L, "interval has wrong type (table expected, got %s)",
+					luaL_typename(L, -1));
+		}
+		open = getindex(L, -1, 1);
+		close = getindex(L, -1, 2);
+		if (open < 0 || open >= close || close > 86400) {
+			return luaL_error(L, "invalid interval [%d, %d)", open, close);
+		}
+		lua_pop(L, 1);
+		spans[2 * (i - 1)] = base + open;
+		spans[2 * (i - 1) + 1] = base + close;
+	}
+	return n;
+}
+
+static int tz_schedule_compare (const void *a, const void *b) {
+	return *(const int32_t *)a < *(const int32_t *)b ? -1
+			: *(const int32_t *)a > *(const int32_t *)b;
+}
+
+static int tz_schedule_merge (int32_t *spans, int count) {
+	int  i, n;
+
+	/* sort by open and merge overlapping or adjacent spans */
+	qsort(spans, count, 2 * sizeof(int32_t), tz_schedule_compare);
+	n = 0;
+	for (i = 0; i < count; i++) {
+		if (n > 0 && spans[2 * i] <= spans[2 * n - 1]) {
+			if (spans[2 * i + 1] > spans[2 * n - 1]) {
+				spans[2 * n - 1] = spans[2 * i + 1];
+			}
+		} else {
+			spans[2 * n] = spans[2 * i];
+			spans[2 * n + 1] = spans[2 * i + 1];
+			n++;
+		}
+	}
+	return n;
+}
+
+static void tz_schedule_window (struct tz_schedule *schedule, int64_t t) {
+	int                   i, d, index, lower, upper, mid;
+	int32_t              *spans;
+	int64_t               pstart, pend, day, weekday, week, start, open, close;
+	struct tz_type       *type;
+	struct tz_exception  *exception;
+
+	/* find offset period of t; the offset is constant in the window */
+	index = tz_index(schedule->data, t);
+	type = index >= 0 ? &schedule->data->types[schedule->data->timetypes[index]]
+			: &schedule->data->types[0];
+	pstart = index >= 0 ? schedule->data->timevalues[index] : INT64_MIN;
+	pend = index + 1 < schedule->data->header.timecnt
+			? schedule->data->timevalues[index + 1] : INT64_MAX;
+
+	/* the window is the local week of t, clipped to the offset period */
+	day = floordiv(t + type->gmtoff, 86400);
+	weekday = (day + 4) % 7;  /* January 1, 1970 was a Thursday */
+	if (weekday < 0) {
+		weekday += 7;
+	}
+	day -= weekday;
+	week = day * 86400;
+	schedule->from = week - type->gmtoff > pstart ? week - type->gmtoff : pstart;
+	schedule->to = week + TZ_WEEK - type->gmtoff < pend ? week + TZ_WEEK - type->gmtoff : pend;
+
+	/* make UTC intervals */
+	schedule->cachecnt = 0;
+	for (d = 0; d < 7; d++, day++) {
+		/* exception? */
+		exception = NULL;
+		lower = 0;
+		upper = schedule->exceptioncnt - 1;
+		while (lower <= upper) {
+			mid = (lower + upper) / 2;
+			if (schedule->exceptions[mid].day < day) {
+				lower = mid + 1;
+			} else if (schedule->exceptions[mid].day > day) {
+				upper = mid - 1;
+			} else {
+				exception = &schedule->exceptions[mid];
+				break;
+			}
+		}
+		if (exception) {
+			spans = &schedule->spans[2 * exception->first];
+			index = exception->count;
+			start = day * 86400;
+		} else {
+			spans = schedule->week;
+			index = schedule->weekcnt;
+			start = week;
+		}
+
+		/* add intervals of the day */
+		for (i = 0; i < index; i++) {
+			open = start + spans[2 * i];
+			close = start + spans[2 * i + 1];
+			if (open < day * 86400) {
+				open = day * 86400;
+			}
+			if (close > (day + 1) * 86400) {
+				close = (day + 1) * 86400;
+			}
+			open -= type->gmtoff;
+			close -= type->gmtoff;
+			if (open < schedule->from) {
+				open = schedule->from;
+			}
+			if (close > schedule->to) {
+				close = schedule->to;
+			}
+			if (open >= close) {
+				continue;
+			}
+			if (schedule->cachecnt > 0 && open <= schedule->cache[2 * schedule->cachecnt - 1]) {
+				schedule->cache[2 * schedule->cachecnt - 1] = close;
+			} else {
+				schedule->cache[2 * schedule->cachecnt] = open;
+				schedule->cache[2 * schedule->cachecnt + 1] = close;
+				schedule->cachecnt++;
+			}
+		}
+	}
+}
+
+static int tz_schedule_isopen (lua_State *L) {
+	int                  i, open;
+	int64_t              t, limit, change;
+	struct tz_schedule  *schedule;
+
+	/* check arguments */
+	schedule = luaL_checkudata(L, 1, TZ_SCHEDULE);
+	t = opttime(L, 2);
+
+	/* find interval ending after t in the cached window */
+	if (t < schedule->from || t >= schedule->to) {
+		tz_schedule_window(schedule, t);
+	}
+	for (i = 0; i < schedule->cachecnt && schedule->cache[2 * i + 1] <= t; i++);
+	open = i < schedule->cachecnt && schedule->cache[2 * i] <= t;
+
+	/* find next change, following intervals across windows */
+	limit = t + TZ_HORIZON;
+	change = INT64_MAX;
+	if (open) {
+		change = schedule->cache[2 * i + 1];
+		while (change == schedule->to && change < limit) {
+			tz_schedule_window(schedule, change);
+			if (schedule->cachecnt == 0 || schedule->cache[0] != change) {
+				break;
+			}
+			change = schedule->cache[1];
+		}
+	} else {
+		while (i == schedule->cachecnt && schedule->to < limit) {
+			tz_schedule_window(schedule, schedule->to);
+			i = 0;
+		}
+		if (i < schedule->cachecnt) {
+			change = schedule->cache[2 * i];
+		}
+	}
+	lua_pushboolean(L, open);
+	if (change < limit) {
+		pushtime(L, change);
+	} else {
+		lua_pushnil(L);
+	}
+	return 2;
+}
+
+static int64_t tz_schedule_count (struct tz_schedule *schedule, int64_t x) {
+	int      i;
+	int64_t  w, p, count, total;
+
+	/* open seconds in local time before x, relative to the week of the epoch */
+	x += 4 * 86400;  /* January 1, 1970 was a Thursday */
+	w = floordiv(x, TZ_WEEK);
+	p = x - w * TZ_WEEK;
+	count = total = 0;
+	for (i = 0; i < schedule->weekcnt; i++) {
+		total += schedule->week[2 * i + 1] - schedule->week[2 * i];
+		if (p > schedule->week[2 * i]) {
+			count += (p < schedule->week[2 * i + 1] ? p : schedule->week[2 * i + 1])
+					- schedule->week[2 * i];
+		}
+	}
+	return w * total + count;
+}
+
+static int64_t tz_schedule_local (struct tz_schedule *schedule, int64_t from, int64_t to) {
+	int                   i, lower, upper, mid;
+	int64_t               count, start, lo, hi, open, close;
+	struct tz_exception  *exception;
+
+	/* whole weeks and partial weeks */
+	count = tz_schedule_count(schedule, to) - tz_schedule_count(schedule, from);
+
+	/* replace weekly intervals on exception days */
+	lower = 0;
+	upper = schedule->exceptioncnt - 1;
+	start = floordiv(from, 86400);
+	while (lower <= upper) {
+		mid = (lower + upper) / 2;
+		if (schedule->exceptions[mid].day < start) {
+			lower = mid + 1;
+		} else {
+			upper = mid - 1;
+		}
+	}
+	for (exception = &schedule->exceptions[lower];
+			exception < &schedule->exceptions[schedule->exceptioncnt]
+			&& exception->day * 86400 < to; exception++) {
+		start = exception->day * 86400;
+		lo = start > from ? start : from;
+		hi = start + 86400 < to ? start + 86400 : to;
+		count -= tz_schedule_count(schedule, hi) - tz_schedule_count(schedule, lo);
+		for (i = exception->first; i < exception->first + exception->count; i++) {
+			open = start + schedule->spans[2 * i];
+			close = start + schedule->spans[2 * i + 1];
+			if (open < lo) {
+				open = lo;
+			}
+			if (close > hi) {
+				close = hi;
+			}
+			if (open < close) {
+				count += close - open;
+			}
+		}
+	}
+	return count;
+}
+
+static int tz_schedule_duration (lua_State *L) {
+	int                  index, sign;
+	int64_t              from, to, end, swap, count;
+	struct tz_type      *type;
+	struct tz_schedule  *schedule;
+
+	/* check arguments */
+	schedule = luaL_checkudata(L, 1, TZ_SCHEDULE);
+	from = checktime(L, 2);
+	to = checktime(L, 3);
+	sign = 1;
+	if (from > to) {
+		swap = from;
+		from = to;
+		to = swap;
+		sign = -1;
+	}
+
+	/* sum open seconds per offset period */
+	count = 0;
+	while (from < to) {
+		index = tz_index(schedule->data, from);
+		type = index >= 0 ? &schedule->data->types[schedule->data->timetypes[index]]
+				: &schedule->data->types[0];
+		end = index + 1 < schedule->data->header.timecnt
+				? schedule->data->timevalues[index + 1] : INT64_MAX;
+		if (end > to) {
+			end = to;
+		}
+		count += tz_schedule_local(schedule, from + type->gmtoff, end + type->gmtoff);
+		from = end;
+	}
+	pushtime(L, sign * count);
+	return 1;
+}
+
+static int tz_schedule_exceptioncompare (const void *a, const void *b) {
+	return ((const struct tz_exception *)a)->day < ((const struct tz_exception *)b)->day ? -1
+			: ((const struct tz_exception *)a)->day > ((const struct tz_exception *)b)->day;
+}
+
+static int tz_schedule (lua_State *L) {
+	int                   i, n, count, wday, day, month, year;
+	size_t                len;
+	const char           *timezone;
+	struct tz_schedule   *schedule;
+	struct tz_exception  *exception;
+
+	/* check arguments */
+	luaL_checktype(L, 1, LUA_TTABLE);
+	timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+	}
+	lua_settop(L, 3);
+
+	/* allocate userdata */
+	schedule = lua_newuserdata(L, sizeof(struct tz_schedule));
+	memset(schedule, 0, sizeof(struct tz_schedule));
+	schedule->ref = LUA_NOREF;
+	luaL_getmetatable(L, TZ_SCHEDULE);
+	lua_setmetatable(L, -2);
+
+	/* reference time zone data */
+	schedule->data = tz_data(L, timezone, len);
+	schedule->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	/* weekly intervals */
+	count = 0;
+	for (wday = 1; wday <= 7; wday++) {
+		lua_rawgeti(L, 1, wday);
+		if (lua_istable(L, -1)) {
+			count += lua_rawlen(L, -1);
+		} else if (!lua_isnil(L, -1)) {
+			return luaL_error(L, "day %d has wrong type (table expected, got %s)",
+					wday, luaL_typename(L, -1));
+		}
+		lua_pop(L, 1);
+	}
+	schedule->week = calloc(count + 1, 2 * sizeof(int32_t));
+	if (!schedule->week) {
+		return luaL_error(L, "cannot allocate schedule");
+	}
+	n = 0;
+	for (wday = 1; wday <= 7; wday++) {
+		lua_rawgeti(L, 1, wday);
+		if (lua_istable(L, -1)) {
+			n += tz_schedule_spans(L, -1, &schedule->week[2 * n], (wday - 1) * 86400);
+		}
+		lua_pop(L, 1);
+	}
+	schedule->weekcnt = tz_schedule_merge(schedule->week, n);
+
+	/* exceptions */
+	n = lua_istable(L, 3) ? (int)lua_rawlen(L, 3) : 0;
+	count = 0;
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 3, i);
+		if (!lua_istable(L, -1)) {
+			return luaL_error(L, "exception has wrong type (table expected, got %s)",
+					luaL_typename(L, -1));
+		}
+		count += lua_rawlen(L, -1);
+		lua_pop(L, 1);
+	}
+	schedule->exceptions = calloc(n + 1, sizeof(struct tz_exception));
+	schedule->spans = calloc(count + 1, 2 * sizeof(int32_t));
+	if (!schedule->exceptions || !schedule->spans) {
+		return luaL_error(L, "cannot allocate schedule");
+	}
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 3, i);
+		day = getfield(L, -1, "day", -1);
+		month = getfield(L, -1, "month", -1);
+		year = getfield(L, -1, "year", -1);
+		if (month < 1 || month > 12 || day < 1 || day > days(year, month)
+				|| year < TZ_J0_YEAR) {
+			return luaL_error(L, "invalid exception date");
+		}
+		exception = &schedule->exceptions[i - 1];
+		exception->day = epochday(year, month, day);
+		exception->first = schedule->spancnt;
+		exception->count = tz_schedule_merge(&schedule->spans[2 * schedule->spancnt],
+				tz_schedule_spans(L, -1, &schedule->spans[2 * schedule->spancnt], 0));
+		schedule->spancnt += exception->count;
+		lua_pop(L, 1);
+	}
+	qsort(schedule->exceptions, n, sizeof(struct tz_exception), tz_schedule_exceptioncompare);
+	for (i = 1; i < n; i++) {
+		if (schedule->exceptions[i].day == schedule->exceptions[i - 1].day) {
+			return luaL_error(L, "duplicate exception date");
+		}
+	}
+	schedule->exceptioncnt = n;
+
+	/* allocate cache; a window has at most 7 exception days */
+	schedule->cache = calloc(schedule->weekcnt + 7 + schedule->spancnt, 2 * sizeof(int64_t));
+	if (!schedule->cache) {
+		return luaL_error(L, "cannot allocate schedule");
+	}
+	return 1;
+}
+
+/*
+ * timers
+ */
+
+static int tz_timers_tostring (lua_State *L) {
+	struct tz_timers  *timers;
+
+	timers = luaL_checkudata(L, 1, TZ_TIMERS);
+	lua_pushfstring(L, TZ_TIMERS ": %p", timers);
+	return 1;
+}
+
+static int tz_timers_gc (lua_State *L) {
+	int                i;
+	struct tz_timers  *timers;
+
+	timers = luaL_checkudata(L, 1, TZ_TIMERS);
+	luaL_unref(L, LUA_REGISTRYINDEX, timers->zones);
+	for (i = 0; i < timers->zonecnt; i++) {
+		luaL_unref(L, LUA_REGISTRYINDEX, timers->zone[i].ref);
+	}
+	free(timers->zone);
+	free(timers->slots);
+	free(timers->heap);
+	return 0;
+}
+
+static int tz_timers_len (lua_State *L) {
+	struct tz_timers  *timers;
+
+	timers = luaL_checkudata(L, 1, TZ_TIMERS);
+	lua_pushinteger(L, timers->heapcnt);
+	return 1;
+}
+
+static inline int tz_timers_less (struct tz_timers *timers, int32_t a, int32_t b) {
+	/* earlier due time first, then lower ID */
+	return timers->slots[a].due < timers->slots[b].due
+			|| (timers->slots[a].due == timers->slots[b].due && a < b);
+}
+
+static void tz_timers_up (struct tz_timers *timers, int pos) {
+	int32_t  slot;
+
+	slot = timers->heap[pos];
+	while (pos > 0 && tz_timers_less(timers, slot, timers->heap[(pos - 1) / 2])) {
+		timers->heap[pos] = timers->heap[(pos - 1) / 2];
+		timers->slots[timers->heap[pos]].pos = pos;
+		pos = (pos - 1) / 2;
+	}
+	timers->heap[pos] = slot;
+	timers->slots[slot].pos = pos;
+}
+
+static void tz_timers_down (struct tz_timers *timers, int pos) {
+	int      child;
+	int32_t  slot;
+
+	slot = timers->heap[pos];
+	while ((child = 2 * pos + 1) < timers->heapcnt) {
+		if (child + 1 < timers->heapcnt && tz_timers_less(timers, timers->heap[child + 1],
+				timers->heap[child])) {
+			child++;
+		}
+		if (!tz_timers_less(timers, timers->heap[child], slot)) {
+			break;
+		}
+		timers->heap[pos] = timers->heap[child];
+		timers->slots[timers->heap[pos]].pos = pos;
+		pos = child;
+	}
+	timers->heap[pos] = slot;
+	timers->slots[slot].pos = pos;
+}
+
+static int64_t tz_timers_due (struct tz_timers *timers, struct tz_timer *timer) {
+	int64_t            local, months;
+	struct tz_data    *data;
+	struct tz_fields   fields;
+
+	/* local time of the occurrence */
+	switch (timer->repeat) {
+	case TZ_REPEAT_YEAR:
+	case TZ_REPEAT_MONTH:
+		tz_breakdown(timer->local, &fields);
+		months = fields.month - 1 + (int64_t)timer->count
+				* (timer->repeat == TZ_REPEAT_YEAR ? 12 : 1);
+		fields.year += (int)(months / 12);
+		fields.month = (int)(months % 12) + 1;
+		if (fields.day > days(fields.year, fields.month)) {
+			fields.day = days(fields.year, fields.month);
+		}
+		local = epochday(fields.year, fields.month, fields.day) * 86400
+				+ fields.hour * 3600 + fields.min * 60 + fields.sec;
+		break;
+
+	case TZ_REPEAT_WEEK:
+		local = timer->local + (int64_t)timer->count * 7 * 86400;
+		break;
+
+	case TZ_REPEAT_DAY:
+		local = timer->local + (int64_t)timer->count * 86400;
+		break;
+
+	default:
+		local = timer->local;
+	}
+
+	/* UTC, as with tz.time */
+	data = timers->zone[timer->zone].data;
+	return local - tz_find(data, local, -1, 1)->gmtoff;
+}
+
+static int tz_timers_skip (struct tz_timers *timers, struct tz_timer *timer, int64_t now) {
+	int64_t   count, period, limit;
+	uint64_t  elapsed;
+
+	/* average length of the period; offsets and calendar irregularities stay below two periods */
+	switch (timer->repeat) {
+	case TZ_REPEAT_YEAR:
+		period = 31556952;
+		limit = INT32_MAX / 12;
+		break;
+
+	case TZ_REPEAT_MONTH:
+		period = 2629746;
+		limit = INT32_MAX;
+		break;
+
+	case TZ_REPEAT_WEEK:
+		period = 7 * 86400;
+		limit = INT32_MAX;
+		break;
+
+	default:
+		period = 86400;
+		limit = INT32_MAX;
+	}
+
+	/* jump to an occurrence before now, and step to the first occurrence after now */
+	elapsed = now > timer->local ? (uint64_t)now - (uint64_t)timer->local : 0;
+	if (elapsed / period > (uint64_t)limit) {
+		return 0;
+	}
+	count = (int64_t)(elapsed / period) - 2;
+	if (count <= timer->count) {
+		count = timer->count + 1;
+	}
+	do {
+		if (count > limit) {
+			return 0;
+		}
+		timer->count = (int32_t)count++;
+		timer->due = tz_timers_due(timers, timer);
+	} while (timer->due <= now);
+	return 1;
+}
+
+static int tz_timers_add (lua_State *L) {
+	int                  zone, repeat, sec, min, hour, day, month, year;
+	size_t               len;
+	int32_t              slot;
+	void                *p;
+	const char          *timezone;
+	struct tz_timer     *timer;
+	struct tz_timers    *timers;
+	struct tz_timerzone *z;
+	static const char   *const repeats[] = { "none", "year", "month", "week", "day", NULL };
+
+	/* check arguments */
+	timers = luaL_checkudata(L, 1, TZ_TIMERS);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	timezone = luaL_optlstring(L, 3, TZ_LOCALTIME, &len);
+	repeat = luaL_checkoption(L, 4, "none", repeats);
+	sec = getfield(L, 2, "sec", 0);
+	min = getfield(L, 2, "min", 0);
+	hour = getfield(L, 2, "hour", 12);
+	day = getfield(L, 2, "day", -1);
+	month = getfield(L, 2, "month", -1);
+	year = getfield(L, 2, "year", -1);
+	if (month < 1) {
+		year += (month - 12) / 12;
+		month = month % 12 + 12;
+	}
+	if (month > 12) {
+		year += (month - 1) / 12;
+		month = (month - 1) % 12 + 1;
+	}
+	if (year < TZ_J0_YEAR + 1) {
+		return luaL_error(L, "year out of range");
+	}
+
+	/* zone index */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, timers->zones);
+	lua_pushlstring(L, timezone, len);
+	lua_rawget(L, -2);
+	if (lua_isnumber(L, -1)) {
+		zone = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+	} else {
+		lua_pop(L, 1);
+		if (timers->zonecnt == TZ_TIMERZONE_MAX) {
+			return luaL_error(L, "too many time zones");
+		}
+		if (timers->zonecnt == timers->zonealloc) {
+			p = realloc(timers->zone, (timers->zonealloc * 2 + 8) * sizeof(*timers->zone));
+			if (!p) {
+				return luaL_error(L, "out of memory");
+			}
+			timers->zone = p;
+			timers->zonealloc = timers->zonealloc * 2 + 8;
+		}
+		zone = timers->zonecnt;
+		z = &timers->zone[zone];
+		z->data = tz_data(L, timezone, len);
+		z->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		timers->zonecnt++;
+		lua_pushlstring(L, timezone, len);
+		lua_pushinteger(L, zone);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+
+	/* allocate slot and heap position */
+	if (timers->free < 0) {
+		p = realloc(timers->slots, (timers->slotcnt * 2 + 16) * sizeof(struct tz_timer));
+		if (!p) {
+			return luaL_error(L, "out of memory");
+		}
+		timers->slots = p;
+		p = realloc(timers->heap, (timers->slotcnt * 2 + 16) * sizeof(int32_t));
+		if (!p) {
+			return luaL_error(L, "out of memory");
+		}
+		timers->heap = p;
+		for (slot = timers->slotcnt * 2 + 15; slot >= timers->slotcnt; slot--) {
+			timers->slots[slot].pos = -1;
+			timers->slots[slot].count = timers->free;
+			timers->free = slot;
+		}
+		timers->slotcnt = timers->slotcnt * 2 + 16;
+	}
+	slot = timers->free;
+	timer = &timers->slots[slot];
+	timers->free = timer->count;
+
+	/* schedule */
+	timer->local = epochday(year, month, day) * 86400 + hour * 3600 + min * 60 + sec;
+	timer->count = 0;
+	timer->zone = zone;
+	timer->repeat = repeat;
+	timer->due = tz_timers_due(timers, timer);
+	timers->heap[timers->heapcnt] = slot;
+	tz_timers_up(timers, timers->heapcnt++);
+	lua_pushinteger(L, slot + 1);
+	return 1;
+}
+
+static int tz_timers_remove (lua_State *L) {
+	int                pos;
+	int32_t            last;
+	lua_Integer        id;
+	struct tz_timers  *timers;
+
+	/* check arguments */
+	timers = luaL_checkudata(L, 1, TZ_TIMERS);
+	id = luaL_checkinteger(L, 2);
+	if (id < 1 || id > timers->slotcnt || timers->slots[id - 1].pos < 0) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	/* replace with the last heap entry, and free slot */
+	pos = timers->slots[id - 1].pos;
+	last = timers->heap[--timers->heapcnt];
+	if (pos < timers->heapcnt) {
+		timers->heap[pos] = last;
+		tz_timers_up(timers, pos);
+		tz_timers_down(timers, timers->slots[last].pos);
+	}
+	timers->slots[id - 1].pos = -1;
+	timers->slots[id - 1].count = timers->free;
+	timers->free = id - 1;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int tz_timers_next (lua_State *L) {
+	struct tz_timers  *timers;
+
+	timers = luaL_checkudata(L, 1, TZ_TIMERS);
+	if (timers->heapcnt > 0) {
+		pushtime(L, timers->slots[timers->heap[0]].due);
+	} else {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int tz_timers_pop_due (lua_State *L) {
+	int                n;
+	int32_t            slot;
+	int64_t            now;
+	struct tz_timer   *timer;
+	struct tz_timers  *timers;
+
+	/* check arguments */
+	timers = luaL_checkudata(L, 1, TZ_TIMERS);
+	now = opttime(L, 2);
+
+	/* pop due timers; repeating timers move to their first occurrence after now, or end */
+	lua_newtable(L);
+	n = 0;
+	while (timers->heapcnt > 0 && timers->slots[timers->heap[0]].due <= now) {
+		slot = timers->heap[0];
+		timer = &timers->slots[slot];
+		lua_pushinteger(L, slot + 1);
+		lua_rawseti(L, -2, ++n);
+		if (timer->repeat != TZ_REPEAT_NONE && tz_timers_skip(timers, timer, now)) {
+			tz_timers_down(timers, 0);
+		} else {
+			timers->heap[0] = timers->heap[--timers->heapcnt];
+			if (timers->heapcnt > 0) {
+				tz_timers_down(timers, 0);
+			}
+			timer->pos = -1;
+			timer->count = timers->free;
+			timers->free = slot;
+		}
+	}
+	return 1;
+}
+
+static int tz_timers (lua_State *L) {
+	struct tz_timers  *timers;
+
+	/* allocate userdata */
+	timers = lua_newuserdata(L, sizeof(struct tz_timers));
+	memset(timers, 0, sizeof(struct tz_timers));
+	timers->zones = LUA_NOREF;
+	timers->free = -1;
+	luaL_getmetatable(L, TZ_TIMERS);
+	lua_setmetatable(L, -2);
+
+	/* zone indexes */
+	lua_newtable(L);
+	timers->zones = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+ * durations
+ */
+
+static int tz_beyond (int64_t a, int64_t b, double limit) {
+	double  product;
+
+	product = (double)a * b;
+	return product > limit || product < -limit;
+}
+
+static const char *const tz_weekdays[] = { "sunday", "monday", "tuesday", "wednesday", "thursday",
+		"friday", "saturday", NULL };
+static const char *const tz_units[] = { "second", "minute", "hour", "day", "week", "month", "year",
+		NULL };
+static const char *const tz_unitaliases[] = { "sec", "min", "hr", "d", "wk", "mo", "yr", NULL };
+
+static int tz_parseduration (const char *p, size_t len, struct tz_duration *duration) {
+	int          sign, time, rank, digits;
+	int64_t      value;
+	const char  *end;
+
+	/* sign and designator */
+	end = p + len;
+	sign = 1;
+	if (p < end && (*p == '-' || *p == '+')) {
+		sign = *p++ == '-' ? -1 : 1;
+	}
+	if (p == end || *p++ != 'P' || p == end) {
+		return 0;
+	}
+
+	/* components, in order: Y, M, W, D, T, H, M, S */
+	memset(duration, 0, sizeof(struct tz_duration));
+	time = 0;
+	rank = -1;
+	while (p < end) {
+		if (*p == 'T') {
+			if (time || ++p == end) {
+				return 0;
+			}
+			time = 1;
+			rank = 3;
+			continue;
+		}
+		value = 0;
+		digits = 0;
+		while (p < end && isdigit((unsigned char)*p)) {
+			if (++digits > TZ_DURATION_DIGITS) {
+				return 0;
+			}
+			value = value * 10 + *p++ - '0';
+		}
+		if (digits == 0 || p == end) {
+			return 0;
+		}
+		switch (*p++) {
+		case 'Y':
+			if (time || rank >= 0) {
+				return 0;
+			}
+			duration->months += value * 12;
+			rank = 0;
+			break;
+
+		case 'M':
+			if (time ? rank >= 5 : rank >= 1) {
+				return 0;
+			}
+			if (time) {
+				duration->secs += value * 60;
+				rank = 5;
+			} else {
+				duration->months += value;
+				rank = 1;
+			}
+			break;
+
+		case 'W':
+			if (time || rank >= 2) {
+				return 0;
+			}
+			duration->days += value * 7;
+			rank = 2;
+			break;
+
+		case 'D':
+			if (time || rank >= 3) {
+				return 0;
+			}
+			duration->days += value;
+			rank = 3;
+			break;
+
+		case 'H':
+			if (!time || rank >= 4) {
+				return 0;
+			}
+			duration->secs += value * 3600;
+			rank = 4;
+			break;
+
+		case 'S':
+			if (!time || rank >= 6) {
+				return 0;
+			}
+			duration->secs += value;
+			rank = 6;
+			break;
+
+		default:
+			return 0;
+		}
+	}
+	if (time && rank < 4) {
+		return 0;
+	}
+	duration->months *= sign;
+	duration->days *= sign;
+	duration->secs *= sign;
+	return 1;
+}
+
+static int tz_parsedatetime (struct tz_data *data, const char *p, size_t len, int64_t *t) {
+	int      year, month, day, hour, min, sec;
+	size_t   n;
+	int64_t  local;
+	int32_t  off;
+
+	/* date, and optional time with optional seconds */
+	if (len < 10 || p[4] != '-' || p[7] != '-') {
+		return 0;
+	}
+	year = isodigits(p, 4);
+	month = isodigits(&p[5], 2);
+	day = isodigits(&p[8], 2);
+	hour = min = sec = 0;
+	n = 10;
+	if (len > 10 && (p[10] == 'T' || p[10] == ' ')) {
+		if (len < 16 || p[13] != ':') {
+			return 0;
+		}
+		hour = isodigits(&p[11], 2);
+		min = isodigits(&p[14], 2);
+		n = 16;
+		if (len >= 19 && p[16] == ':') {
+			sec = isodigits(&p[17], 2);
+			n = 19;
+		}
+	}
+	if (year < 0 || month < 0 || day < 0 || hour < 0 || min < 0 || sec < 0
+			|| !isotime(year, month, day, hour, min, sec, &local)) {
+		return 0;
+	}
+
+	/* local time, or offset */
+	if (n == len) {
+		*t = local - tz_find(data, local, -1, 1)->gmtoff;
+		return 1;
+	}
+	if (n > 10 && isooffset(&p[n], len - n, &off)) {
+		*t = local - off;
+		return 1;
+	}
+	return 0;
+}
+
+static int tz_parseinterval (struct tz_data *data, const char *p, size_t len,
+		struct tz_interval *interval) {
+	int64_t      count;
+	const char  *end, *slash;
+
+	/* recurrences */
+	end = p + len;
+	interval->count = 1;
+	if (p < end && *p == 'R') {
+		count = -1;
+		while (++p < end && isdigit((unsigned char)*p)) {
+			if (count > INT32_MAX) {
+				return 0;
+			}
+			count = (count > 0 ? count * 10 : 0) + *p - '0';
+		}
+		if (p == end || *p++ != '/') {
+			return 0;
+		}
+		interval->count = count;
+	}
+
+	/* start and end, start and duration, or duration and end */
+	slash = memchr(p, '/', end - p);
+	if (!slash || memchr(slash + 1, '/', end - slash - 1)) {
+		return 0;
+	}
+	memset(&interval->duration, 0, sizeof(struct tz_duration));
+	interval->start = interval->end = 0;
+	if (*p == 'P') {
+		interval->mode = TZ_INTERVAL_DURATION_END;
+		return interval->count >= 0 && tz_parseduration(p, slash - p, &interval->duration)
+				&& tz_parsedatetime(data, slash + 1, end - slash - 1, &interval->end);
+	}
+	if (slash + 1 < end && slash[1] == 'P') {
+		interval->mode = TZ_INTERVAL_START_DURATION;
+		return tz_parsedatetime(data, p, slash - p, &interval->start)
+				&& tz_parseduration(slash + 1, end - slash - 1, &interval->duration);
+	}
+	interval->mode = TZ_INTERVAL_START_END;
+	return tz_parsedatetime(data, p, slash - p, &interval->start)
+			&& tz_parsedatetime(data, slash + 1, end - slash - 1, &interval->end);
+}
+
+static int tz_addduration (struct tz_data *data, int64_t t, const struct tz_duration *duration,
+		int64_t k, int64_t *result) {
+	int               month, day, index;
+	int32_t           off;
+	int64_t           local, months, year, secs;
+	struct tz_type   *type, *prev;
+	struct tz_fields  fields;
+
+	/* check range, keeping products clear of overflow */
+	if (tz_beyond(duration->months, k, 1e10) || tz_beyond(duration->days, k, 1e12)
+			|| tz_beyond(duration->secs, k, 1e17)) {
+		return 0;
+	}
+
+	/* calendar part, in local time; the day is clamped to the month */
+	if (duration->months * k != 0 || duration->days * k != 0) {
+		off = tz_find(data, t, -1, 0)->gmtoff;
+		local = t + off;
+		if (local < TZ_J0_TIME) {
+			return 0;
+		}
+		tz_breakdown(local, &fields);
+		months = (int64_t)fields.year * 12 + fields.month - 1 + duration->months * k;
+		year = floordiv(months, 12);
+		month = months - year * 12 + 1;
+		if (year <= TZ_J0_YEAR || year > INT32_MAX / 2) {
+			return 0;
+		}
+		day = fields.day <= days(year, month) ? fields.day : days(year, month);
+		local = (epochday(year, month, day) + duration->days * k) * 86400
+				+ fields.hour * 3600 + fields.min * 60 + fields.sec;
+		if (local < TZ_J0_TIME) {
+			return 0;
+		}
+
+		/* back to UTC; shifting forward keeps the original offset if it is valid for the new
+		 * local time, and otherwise, an ambiguous local time resolves to its earlier instant */
+		if (duration->months * k >= 0 && duration->days * k >= 0
+				&& tz_find(data, local - off, -1, 0)->gmtoff == off) {
+			t = local - off;
+		} else {
+			type = tz_find(data, local, -1, 1);
+			t = local - type->gmtoff;
+			index = tz_index(data, t);
+			prev = index > 0 ? &data->types[data->timetypes[index - 1]]
+					: index == 0 ? &data->types[0] : NULL;
+			if (prev && prev->gmtoff > type->gmtoff
+					&& tz_find(data, local - prev->gmtoff, -1, 0)->gmtoff == prev->gmtoff) {
+				t = local - prev->gmtoff;
+			}
+		}
+	}
+
+	/* elapsed part */
+	secs = duration->secs * k;
+	if ((secs > 0 && t > INT64_MAX - secs) || t + secs < TZ_J0_TIME) {
+		return 0;
+	}
+	*result = t + secs;
+	return 1;
+}
+
+static int tz_occurrence (struct tz_data *data, struct tz_interval *interval, int64_t k,
+		int64_t *start, int64_t *end) {
+	int64_t  span;
+
+	switch (interval->mode) {
+	case TZ_INTERVAL_START_END:
+		span = interval->end - interval->start;
+		if (tz_beyond(span, k, 1e17)) {
+			return 0;
+		}
+		*start = interval->start + span * k;
+		*end = *start + span;
+		return 1;
+
+	case TZ_INTERVAL_START_DURATION:
+		return tz_addduration(data, interval->start, &interval->duration, k, start)
+				&& tz_addduration(data, interval->start, &interval->duration, k + 1, end);
+
+	default:
+		return tz_addduration(data, interval->end, &interval->duration,
+				-(interval->count - k), start)
+				&& tz_addduration(data, interval->end, &interval->duration,
+				-(interval->count - k - 1), end);
+	}
+}
+
+static int tz_add (lua_State *L) {
+	size_t               len;
+	int64_t              t;
+	const char          *duration, *timezone;
+	struct tz_data      *data;
+	struct tz_duration   parsed;
+
+	/* check arguments */
+	t = checktime(L, 1);
+	duration = luaL_checklstring(L, 2, &len);
+	if (!tz_parseduration(duration, len, &parsed)) {
+		return luaL_argerror(L, 2, "malformed duration");
+	}
+	timezone = luaL_optlstring(L, 3, TZ_LOCALTIME, &len);
+	data = tz_data(L, timezone, len);
+
+	/* add */
+	if (tz_addduration(data, t, &parsed, 1, &t)) {
+		pushtime(L, t);
+	} else {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int tz_intervalfn (lua_State *L) {
+	size_t               len, ilen;
+	int64_t              start, end;
+	const char          *interval, *timezone;
+	struct tz_data      *data;
+	struct tz_interval   parsed;
+
+	/* check arguments */
+	interval = luaL_checklstring(L, 1, &ilen);
+	timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
+	data = tz_data(L, timezone, len);
+	if (!tz_parseinterval(data, interval, ilen, &parsed)) {
+		return luaL_argerror(L, 1, "malformed interval");
+	}
+
+	/* first occurrence and recurrences */
+	if (!tz_occurrence(data, &parsed, 0, &start, &end)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	pushtime(L, start);
+	pushtime(L, end);
+	if (parsed.count >= 0) {
+		pushtime(L, parsed.count);
+	} else {
+		lua_pushnil(L);
+	}
+	return 3;
+}
+
+static int tz_occurrences_next (lua_State *L) {
+	int64_t              start, end;
+	struct tz_data      *data;
+	struct tz_interval  *interval;
+
+	interval = lua_touserdata(L, lua_upvalueindex(1));
+	data = lua_touserdata(L, lua_upvalueindex(2));
+	if ((interval->count >= 0 && interval->next >= interval->count)
+			|| !tz_occurrence(data, interval, interval->next, &start, &end)) {
+		return 0;
+	}
+	interval->next++;
+	pushtime(L, start);
+	pushtime(L, end);
+	return 2;
+}
+
+static int tz_occurrences (lua_State *L) {
+	size_t               len, ilen;
+	const char          *interval, *timezone;
+	struct tz_data      *data;
+	struct tz_interval  *parsed;
+
+	/* check arguments */
+	interval = luaL_checklstring(L, 1, &ilen);
+	timezone = luaL_optlstring(L, 2, TZ_LOCALTIME, &len);
+
+	/* iterator with the parsed interval and the TZ data as upvalues */
+	parsed = lua_newuserdata(L, sizeof(struct tz_interval));
+	data = tz_data(L, timezone, len);
+	if (!tz_parseinterval(data, interval, ilen, parsed)) {
+		return luaL_argerror(L, 1, "malformed interval");
+	}
+	parsed->next = 0;
+	lua_pushcclosure(L, tz_occurrences_next, 2);
+	return 1;
+}
+
+
+/*
+ * relative dates
+ */
+
+static int tz_resolvetokens (const char *phrase, size_t len, char *buffer,
+		struct tz_token *tokens) {
+	int     n;
+	size_t  i;
+
+	/* lowercase words, separated by blanks or commas */
+	if (len >= TZ_RESOLVE_LENGTH) {
+		return -1;
+	}
+	n = 0;
+	for (i = 0; i < len; i++) {
+		buffer[i] = tolower((unsigned char)phrase[i]);
+		if (isspace((unsigned char)buffer[i]) || buffer[i] == ',') {
+			continue;
+		}
+		if (i == 0 || isspace((unsigned char)buffer[i - 1]) || buffer[i - 1] == ',') {
+			if (n == TZ_RESOLVE_TOKENS) {
+				return -1;
+			}
+			tokens[n].s = &buffer[i];
+			tokens[n++].len = 0;
+		}
+		tokens[n - 1].len++;
+	}
+	return n;
+}
+
+static int tz_resolveword (const struct tz_token *token, const char *word) {
+	return token->len == strlen(word) && memcmp(token->s, word, token->len) == 0;
+}
+
+static int tz_resolveweekday (const struct tz_token *token) {
+	int  i;
+
+	/* full names, or prefixes of at least three letters */
+	for (i = 0; tz_weekdays[i]; i++) {
+		if (token->len >= 3 && token->len <= strlen(tz_weekdays[i])
+				&& memcmp(token->s, tz_weekdays[i], token->len) == 0) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static int tz_resolveunit (const struct tz_token *token) {
+	int              i;
+	struct tz_token  singular;
+
+	/* names and aliases, optionally in plural */
+	singular = *token;
+	if (singular.len > 1 && singular.s[singular.len - 1] == 's') {
+		singular.len--;
+	}
+	for (i = 0; tz_units[i]; i++) {
+		if (tz_resolveword(token, tz_units[i]) || tz_resolveword(token, tz_unitaliases[i])
+				|| tz_resolveword(&singular, tz_units[i])
+				|| tz_resolveword(&singular, tz_unitaliases[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int tz_resolvecount (const struct tz_token *token, int64_t *count) {
+	size_t  i;
+
+	if (tz_resolveword(token, "a") || tz_resolveword(token, "an")) {
+		*count = 1;
+		return 1;
+	}
+	if (token->len == 0 || token->len > TZ_DURATION_DIGITS) {
+		return 0;
+	}
+	*count = 0;
+	for (i = 0; i < token->len; i++) {
+		if (!isdigit((unsigned char)token->s[i])) {
+			return 0;
+		}
+		*count = *count * 10 + token->s[i] - '0';
+	}
+	return 1;
+}
+
+static int tz_resolvetime (const struct tz_token *tokens, int n, int *i, int at, int *secs) {
+	int          hour, min, sec, colon, meridiem;
+	const char  *p, *end;
+
+	/* named times */
+	if (tz_resolveword(&tokens[*i], "noon") || tz_resolveword(&tokens[*i], "midnight")) {
+		*secs = tokens[*i].s[0] == 'n' ? 12 * 3600 : 0;
+		(*i)++;
+		return 1;
+	}
+
+	/* H[:MM[:SS]], followed by an optional meridiem in the same or the next word */
+	p = tokens[*i].s;
+	end = p + tokens[*i].len;
+	hour = min = sec = colon = 0;
+	if (p == end || !isdigit((unsigned char)*p)) {
+		return 0;
+	}
+	hour = *p++ - '0';
+	if (p < end && isdigit((unsigned char)*p)) {
+		hour = hour * 10 + *p++ - '0';
+	}
+	if (end - p >= 3 && p[0] == ':' && isdigit((unsigned char)p[1])
+			&& isdigit((unsigned char)p[2])) {
+		min = (p[1] - '0') * 10 + p[2] - '0';
+		p += 3;
+		colon = 1;
+		if (end - p >= 3 && p[0] == ':' && isdigit((unsigned char)p[1])
+				&& isdigit((unsigned char)p[2])) {
+			sec = (p[1] - '0') * 10 + p[2] - '0';
+			p += 3;
+		}
+	}
+	meridiem = 0;
+	if (end - p == 2 && (p[0] == 'a' || p[0] == 'p') && p[1] == 'm') {
+		meridiem = p[0];
+	} else if (p != end) {
+		return 0;
+	} else if (*i + 1 < n && (tz_resolveword(&tokens[*i + 1], "am")
+			|| tz_resolveword(&tokens[*i + 1], "pm"))) {
+		meridiem = tokens[++(*i)].s[0];
+	}
+	if (min > 59 || sec > 59 || (!meridiem && (hour > 23 || (!colon && !at)))
+			|| (meridiem && (hour < 1 || hour > 12))) {
+		return 0;
+	}
+	if (meridiem) {
+		hour = hour % 12 + (meridiem == 'p' ? 12 : 0);
+	}
+	*secs = hour * 3600 + min * 60 + sec;
+	(*i)++;
+	return 1;
+}
+
+static int tz_resolve (lua_State *L) {
+	size_t               len, phraselen;
+	int                  n, i, wday, unit, sign, day, secs, at;
+	int64_t              t, local, count;
+	const char          *phrase, *timezone;
+	char                 buffer[TZ_RESOLVE_LENGTH];
+	struct tz_data      *data;
+	struct tz_token      tokens[TZ_RESOLVE_TOKENS];
+	struct tz_fields     fields;
+	struct tz_duration   duration;
+	static const int     unitsecs[] = { 1, 60, 3600 };
+
+	/* check arguments */
+	phrase = luaL_checklstring(L, 1, &phraselen);
+	t = opttime(L, 2);
+	timezone = luaL_optlstring(L, 3, TZ_LOCALTIME, &len);
+	data = tz_data(L, timezone, len);
+	n = tz_resolvetokens(phrase, phraselen, buffer, tokens);
+	if (n <= 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	/* leading time of day */
+	i = 0;
+	secs = -1;
+	at = tz_resolveword(&tokens[i], "at");
+	if (at && n > 1) {
+		i++;
+	}
+	if (!tz_resolvetime(tokens, n, &i, at, &secs)) {
+		i = 0;
+	}
+
+	/* day: now, today, tomorrow, yesterday, [next|last] weekday, next|last unit,
+			in count unit, count unit ago */
+	memset(&duration, 0, sizeof(struct tz_duration));
+	wday = 0;
+	sign = 0;
+	day = 0;  /* anchors to the start of a day */
+	if (i < n) {
+		if (tz_resolveword(&tokens[i], "now") && secs < 0 && i + 1 == n) {
+			i++;
+		} else if (tz_resolveword(&tokens[i], "today")) {
+			day = 1;
+			i++;
+		} else if (tz_resolveword(&tokens[i], "tomorrow")
+				|| tz_resolveword(&tokens[i], "yesterday")) {
+			duration.days = tokens[i].s[0] == 't' ? 1 : -1;
+			day = 1;
+			i++;
+		} else if (tz_resolveword(&tokens[i], "next") || tz_resolveword(&tokens[i], "last")
+				|| tz_resolveword(&tokens[i], "this")) {
+			sign = tokens[i].s[0] == 'n' ? 1 : tokens[i].s[0] == 'l' ? -1 : 0;
+			if (++i == n) {
+				lua_pushnil(L);
+				return 1;
+			}
+			if ((wday = tz_resolveweekday(&tokens[i])) != 0) {
+				day = 1;
+			} else if (sign != 0 && (unit = tz_resolveunit(&tokens[i])) >= 3) {
+				if (unit == 3 || unit == 4) {
+					duration.days = sign * (unit == 3 ? 1 : 7);
+				} else {
+					duration.months = sign * (unit == 5 ? 1 : 12);
+				}
+			} else {
+				lua_pushnil(L);
+				return 1;
+			}
+			i++;
+		} else if ((wday = tz_resolveweekday(&tokens[i])) != 0) {
+			day = 1;
+			i++;
+		} else {
+			sign = 1;
+			if (tz_resolveword(&tokens[i], "in")) {
+				i++;
+			} else {
+				sign = -1;
+			}
+			if (i + 1 >= n || !tz_resolvecount(&tokens[i], &count)
+					|| (unit = tz_resolveunit(&tokens[i + 1])) < 0) {
+				if (sign < 0 && i == 0 && secs < 0) {
+					lua_pushnil(L);
+					return 1;
+				}
+				sign = 0;  /* not a day; may be a trailing time of day */
+			} else {
+				i += 2;
+				if (sign < 0) {
+					if (i == n || !tz_resolveword(&tokens[i], "ago")) {
+						lua_pushnil(L);
+						return 1;
+					}
+					i++;
+				}
+				count *= sign;
+				if (unit < 3) {
+					if (secs >= 0) {
+						lua_pushnil(L);
+						return 1;
+					}
+					duration.secs = count * unitsecs[unit];
+				} else if (unit < 5) {
+					duration.days = count * (unit == 3 ? 1 : 7);
+				} else {
+					duration.months = count * (unit == 5 ? 1 : 12);
+				}
+			}
+		}
+	}
+
+	/* trailing time of day */
+	if (secs < 0 && i < n) {
+		at = tz_resolveword(&tokens[i], "at");
+		if (at) {
+			i++;
+		}
+		if (i == n || !tz_resolvetime(tokens, n, &i, at, &secs) || duration.secs != 0) {
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+	if (i != n) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	/* weekday, relative to the local day of the reference time */
+	if (wday) {
+		local = t + tz_find(data, t, -1, 0)->gmtoff;
+		if (local < TZ_J0_TIME) {
+			lua_pushnil(L);
+			return 1;
+		}
+		tz_breakdown(local, &fields);
+		if (sign > 0) {
+			duration.days = (wday - fields.wday + 6) % 7 + 1;
+		} else if (sign < 0) {
+			duration.days = -((fields.wday - wday + 6) % 7 + 1);
+		} else {
+			duration.days = (wday - fields.wday + 7) % 7;
+		}
+	}
+
+	/* apply the calendar and elapsed parts, then set the time of day in the local day */
+	if (!tz_addduration(data, t, &duration, 1, &t)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if (day || secs >= 0) {
+		local = t + tz_find(data, t, -1, 0)->gmtoff;
+		if (local < TZ_J0_TIME) {
+			lua_pushnil(L);
+			return 1;
+		}
+		tz_breakdown(local, &fields);
+		local += (secs >= 0 ? secs : 0) - fields.hour * 3600 - fields.min * 60 - fields.sec;
+		t = local - tz_find(data, local, -1, 1)->gmtoff;
+	}
+	pushtime(L, t);
+	return 1;
+}
+
+
+/*
+ * scales
+ */
+
+static int tz_leap (int64_t t, int gps) {
+	int  i;
+
+	/* TAI minus UTC at a time, or at a GPS time; zero before 1972 */
+	for (i = LEAP_COUNT - 1; i >= 0; i--) {
+		if (t >= (gps ? LEAP_SECONDS[i][0] - TZ_GPS_EPOCH + LEAP_SECONDS[i][1] - TZ_GPS_TAI
+				: LEAP_SECONDS[i][0])) {
+			return LEAP_SECONDS[i][1];
+		}
+	}
+	return 0;
+}
+
+static int tz_fromscale (struct tz_data *data, int scale, double value, double *t) {
+	double  local;
+
+	if (value != value) {
+		return 0;
+	}
+	switch (scale) {
+	case TZ_SCALE_UNIX:
+		*t = value;
+		break;
+
+	case TZ_SCALE_EXCEL:
+		if (!data) {
+			*t = (value - TZ_EXCEL_EPOCH) * 86400;
+			break;
+		}
+		local = (value - TZ_EXCEL_EPOCH) * 86400;
+		if (local < TZ_J0_TIME || local > INT64_MAX / 2) {
+			return 0;
+		}
+		*t = local - tz_find(data, (int64_t)floor(local), -1, 1)->gmtoff;
+		break;
+
+	case TZ_SCALE_JD:
+		*t = (value - TZ_EPOCH + 0.5) * 86400;
+		break;
+
+	case TZ_SCALE_MJD:
+		*t = (value - TZ_MJD_EPOCH) * 86400;
+		break;
+
+	case TZ_SCALE_GPS:
+		if (value < -1e17 || value > 1e17) {
+			return 0;
+		}
+		*t = value + TZ_GPS_EPOCH - (tz_leap((int64_t)floor(value), 1) - TZ_GPS_TAI);
+		break;
+
+	case TZ_SCALE_NTP:
+		*t = value - TZ_NTP_EPOCH;
+		break;
+	}
+	return 1;
+}
+
+static int tz_toscale (struct tz_data *data, int scale, double t, double *value) {
+	switch (scale) {
+	case TZ_SCALE_UNIX:
+		*value = t;
+		break;
+
+	case TZ_SCALE_EXCEL:
+		if (data) {
+			if (t < TZ_J0_TIME || t > INT64_MAX / 2) {
+				return 0;
+			}
+			t += tz_find(data, (int64_t)floor(t), -1, 0)->gmtoff;
+		}
+		*value = t / 86400 + TZ_EXCEL_EPOCH;
+		break;
+
+	case TZ_SCALE_JD:
+		*value = t / 86400 + TZ_EPOCH - 0.5;
+		break;
+
+	case TZ_SCALE_MJD:
+		*value = t / 86400 + TZ_MJD_EPOCH;
+		break;
+
+	case TZ_SCALE_GPS:
+		if (t < -1e17 || t > 1e17) {
+			return 0;
+		}
+		*value = t - TZ_GPS_EPOCH + (tz_leap((int64_t)floor(t), 0) - TZ_GPS_TAI);
+		break;
+
+	case TZ_SCALE_NTP:
+		*value = t + TZ_NTP_EPOCH;
+		break;
+	}
+	return 1;
+}
+
+static void tz_pushscale (lua_State *L, int scale, double value) {
+#if LUA_VERSION_NUM >= 503
+	/* whole seconds as integers */
+	if ((scale == TZ_SCALE_UNIX || scale == TZ_SCALE_GPS || scale == TZ_SCALE_NTP)
+			&& value == floor(value) && value >= -9007199254740992.0
+			&& value <= 9007199254740992.0) {
+		lua_pushinteger(L, (lua_Integer)value);
+		return;
+	}
+#else
+	(void)scale;
+#endif
+	lua_pushnumber(L, (lua_Number)value);
+}
+
+static int tz_convert (lua_State *L) {
+	static const char *const scales[] = { "unix", "excel", "jd", "mjd", "gps", "ntp", NULL };
+	int              i, n, from, to;
+	size_t           len;
+	double           t, value;
+	const char      *timezone;
+	struct tz_data  *data;
+
+	/* check arguments */
+	if (!lua_istable(L, 1)) {
+		luaL_checknumber(L, 1);
+	}
+	from = luaL_checkoption(L, 2, NULL, scales);
+	to = luaL_checkoption(L, 3, NULL, scales);
+	data = NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		timezone = luaL_checklstring(L, 4, &len);
+		data = tz_data(L, timezone, len);
+	}
+
+	/* single */
+	if (!lua_istable(L, 1)) {
+		if (tz_fromscale(data, from, (double)lua_tonumber(L, 1), &t)
+				&& tz_toscale(data, to, t, &value)) {
+			tz_pushscale(L, to, value);
+		} else {
+			lua_pushnil(L);
+		}
+		return 1;
+	}
+
+	/* batch */
+	n = (int)lua_rawlen(L, 1);
+	lua_createtable(L, n, 0);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 1, i);
+		if (!lua_isnumber(L, -1)) {
+			return luaL_error(L, "element %d is not a number", i);
+		}
+		value = (double)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		if (tz_fromscale(data, from, value, &t) && tz_toscale(data, to, t, &value)) {
+			tz_pushscale(L, to, value);
+		} else {
+			lua_pushboolean(L, 0);
+		}
+		lua_rawseti(L, -2, i);
+	}
+	return 1;
+}
+
+
+/*
  * interface
  */
 
@@ -619,8 +5534,53 @@ int luaopen_tz (lua_State *L) {
 	static const luaL_Reg functions[] = {
 		{ "info", tz_info },
 		{ "type", tz_info },  /* deprecated */
+		{ "strategy", tz_strategyinfo },
+		{ "breakdown", tz_breakdownfn },
+		{ "isoformat", tz_isoformat },
+		{ "isoparse", tz_isoparse },
 		{ "date", tz_date },
+		{ "datekey", tz_datekey },
+		{ "datepath", tz_datepath },
 		{ "time", tz_time },
+		{ "diff", tz_diff },
+		{ "add", tz_add },
+		{ "interval", tz_intervalfn },
+		{ "occurrences", tz_occurrences },
+		{ "resolve", tz_resolve },
+		{ "convert", tz_convert },
+		{ "delta", tz_delta },
+		{ "overlap", tz_overlap },
+		{ "schedule", tz_schedule },
+		{ "timers", tz_timers },
+		{ "async", tz_async },
+		{ "trace", tz_trace },
+		{ "dump", tz_dump },
+		{ "load_image", tz_load_image },
+		{ "zone_from_tzif", tz_zone_from_tzif },
+		{ "export", tz_export },
+		{ "exportdir", tz_exportdir },
+		{ "cachedir", tz_cachedir },
+		{ "cachewrite", tz_cachewrite },
+#if LUA_VERSION_NUM >= 503
+		{ "await", tz_await },
+#endif
+		{ NULL, NULL }
+	};
+	static const luaL_Reg loader_methods[] = {
+		{ "fd", tz_loader_fd },
+		{ "ready", tz_loader_ready },
+		{ NULL, NULL }
+	};
+	static const luaL_Reg timers_methods[] = {
+		{ "add", tz_timers_add },
+		{ "remove", tz_timers_remove },
+		{ "next", tz_timers_next },
+		{ "pop_due", tz_timers_pop_due },
+		{ NULL, NULL }
+	};
+	static const luaL_Reg schedule_methods[] = {
+		{ "isopen", tz_schedule_isopen },
+		{ "duration", tz_schedule_duration },
 		{ NULL, NULL }
 	};
 
@@ -631,6 +5591,11 @@ int luaopen_tz (lua_State *L) {
 	luaL_register(L, luaL_checkstring(L, 1), functions);
 #endif
 
+	/* SIMD kernels */
+	pthread_once(&tz_simd_once, tz_simdinit);
+	lua_pushstring(L, tz_simd == TZ_SIMD_AVX2 ? "avx2" : "none");
+	lua_setfield(L, -2, "simd");
+
 	/* TZ metatable */	
 	luaL_newmetatable(L, TZ_DATA);
 	lua_pushcfunction(L, tz_tostring);
@@ -639,5 +5604,68 @@ int luaopen_tz (lua_State *L) {
 	lua_setfield(L, -2, "__gc");
 	lua_pop(L, 1);
 
+	/* bundle writer, collected as the state closes */
+	lua_newuserdata(L, 1);
+	luaL_newmetatable(L, TZ_WRITER);
+	lua_pushcfunction(L, tz_writer_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, TZ_WRITERS);
+
+	/* trace metatable */
+	luaL_newmetatable(L, TZ_TRACE);
+	lua_pushcfunction(L, tz_trace_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, tz_trace_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	/* loader metatable */
+	luaL_newmetatable(L, TZ_LOADER);
+	lua_pushcfunction(L, tz_loader_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, tz_loader_gc);
+	lua_setfield(L, -2, "__gc");
+#if LUA_VERSION_NUM >= 502
+	luaL_newlib(L, loader_methods);
+#else
+	lua_newtable(L);
+	luaL_register(L, NULL, loader_methods);
+#endif
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* schedule metatable */
+	luaL_newmetatable(L, TZ_SCHEDULE);
+	lua_pushcfunction(L, tz_schedule_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, tz_schedule_gc);
+	lua_setfield(L, -2, "__gc");
+#if LUA_VERSION_NUM >= 502
+	luaL_newlib(L, schedule_methods);
+#else
+	lua_newtable(L);
+	luaL_register(L, NULL, schedule_methods);
+#endif
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* timers metatable */
+	luaL_newmetatable(L, TZ_TIMERS);
+	lua_pushcfunction(L, tz_timers_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, tz_timers_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, tz_timers_len);
+	lua_setfield(L, -2, "__len");
+#if LUA_VERSION_NUM >= 502
+	luaL_newlib(L, timers_methods);
+#else
+	lua_newtable(L);
+	luaL_register(L, NULL, timers_methods);
+#endif
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	return 1;
 }
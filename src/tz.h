@@ -18,10 +18,40 @@
 #define TZ_UTC        "UTC"                   /* UTC time zone */
 #define TZ_DATA       "tz.data"               /* TZ data metatable */
 #define TZ_CACHE      "tz.cache"              /* TZ cache registry key */
+#define TZ_SCHEDULE   "tz.schedule"           /* schedule metatable */
+#define TZ_TIMERS     "tz.timers"             /* timer queue metatable */
+#define TZ_LOADER     "tz.loader"             /* loader metatable */
+#define TZ_LOADERS    "tz.loaders"            /* pending loaders registry key */
+#define TZ_CACHEDIR   "tz.cachedir"           /* compiled image directory registry key */
+#define TZ_BUNDLE     "tz.bundle"             /* compiled cache bundle file name */
+#define TZ_WRITER     "tz.writer"             /* bundle writer metatable */
+#define TZ_WRITERS    "tz.writers"            /* bundle writer registry key */
+#define TZ_TRACE      "tz.trace"              /* trace metatable */
+#define TZ_TRACER     "tz.tracer"             /* active trace registry key */
 #define TZ_EPOCH      2440588                 /* Julian day number of epoch (January 1, 1970) */
 #define TZ_J0_TIME    -210866803200           /* Julian day 0 time (November 24, -4713) */
 #define TZ_J0_YEAR    -4713                   /* Julian day 0 year (November 24, -4713) */
 
+/* images: image header, time zone name, and data block, in host byte order */
+#define TZ_IMAGE_MAGIC    "TZim"
+#define TZ_IMAGE_VERSION  1
+#define TZ_IMAGE_MARK     0x01020304
+
+/* cache bundle */
+#define TZ_BUNDLE_MAGIC    "TZbd"
+#define TZ_BUNDLE_VERSION  2
+#define TZ_BUNDLE_MARK     0x01020304
+
+/* trace files: magic, version, and byte order mark, followed by records in host byte order */
+#define TZ_TRACE_MAGIC    "TZtr"
+#define TZ_TRACE_VERSION  1
+#define TZ_TRACE_MARK     0x01020304
+#define TZ_TRACE_STRING   1  /* kind, id (u16), length (u16), bytes */
+#define TZ_TRACE_INFO     2  /* kind, time (i64), timezone id (u16) */
+#define TZ_TRACE_DATE     3  /* kind, time (i64), timezone id (u16), format id (u16) */
+#define TZ_TRACE_TIME     4  /* kind, timezone id (u16), fields (i32) */
+#define TZ_TRACE_FIELDS   9  /* year, month, day, hour, min, sec, isdst, flags, off */
+
 
 int luaopen_tz(lua_State *L);
 
@@ -193,3 +193,547 @@ t.sec = -1
 assert(tz.time(t) == nil)
 assert(tz.date(ISO, -210866803200, "UTC") == "-4713-11-24T00:00:00")
 assert(tz.date(ISO, -210866803201, "UTC") == nil)
+
+-- Schedule
+local ZH = "Europe/Zurich"
+local function zh (year, month, day, hour, min)
+	return tz.time({ year = year, month = month, day = day, hour = hour or 0, min = min or 0 }, ZH)
+end
+local office = { 9 * 3600, 17 * 3600 }
+local s = tz.schedule({ nil, { office }, { office }, { office }, { office }, { office } }, ZH, {
+	{ year = 2014, month = 12, day = 25 },
+	{ year = 2014, month = 12, day = 24, { 9 * 3600, 12 * 3600 } }
+})
+local open, change = s:isopen(1392456870)  -- Saturday
+assert(open == false and change == zh(2014, 2, 17, 9))
+open, change = s:isopen(zh(2014, 2, 17, 9))
+assert(open == true and change == zh(2014, 2, 17, 17))
+open, change = s:isopen(zh(2014, 2, 17, 16, 59))
+assert(open == true and change == zh(2014, 2, 17, 17))
+open, change = s:isopen(zh(2014, 2, 17, 17))
+assert(open == false and change == zh(2014, 2, 18, 9))
+open, change = s:isopen(zh(2014, 3, 28, 18))  -- DST change on Sunday
+assert(open == false and change == zh(2014, 3, 31, 9))
+open, change = s:isopen(zh(2014, 12, 24, 11))
+assert(open == true and change == zh(2014, 12, 24, 12))
+open, change = s:isopen(zh(2014, 12, 24, 13))
+assert(open == false and change == zh(2014, 12, 26, 9))
+local s = tz.schedule({ nil, nil, nil, nil, nil, { { 22 * 3600, 86400 } }, { { 0, 2 * 3600 } } }, ZH)
+open, change = s:isopen(zh(2014, 2, 14, 23))
+assert(open == true and change == zh(2014, 2, 15, 2))
+local s = tz.schedule({ { { 0, 86400 } }, { { 0, 86400 } }, { { 0, 86400 } }, { { 0, 86400 } },
+		{ { 0, 86400 } }, { { 0, 86400 } }, { { 0, 86400 } } }, ZH)
+open, change = s:isopen(1392456870)
+assert(open == true and change == nil)
+assert(not pcall(tz.schedule, { { { 9 * 3600, 8 * 3600 } } }, ZH))
+
+-- Schedule duration
+local day = { { 0, 86400 } }
+local s = tz.schedule({ nil, day, day, day, day, day }, ZH, { { year = 2014, month = 4, day = 18 } })
+assert(s:duration(zh(2014, 2, 17, 9), zh(2014, 2, 17, 17)) == 8 * 3600)
+assert(s:duration(zh(2014, 2, 14, 12), zh(2014, 2, 17, 12)) == 86400)
+assert(s:duration(zh(2014, 2, 17, 12), zh(2014, 2, 14, 12)) == -86400)
+assert(s:duration(zh(2014, 1, 6), zh(2014, 6, 2)) == (21 * 5 - 1) * 86400)
+assert(s:duration(zh(2014, 1, 4), zh(2014, 1, 5)) == 0)
+local s = tz.schedule({ day, day, day, day, day, day, day }, ZH)
+assert(s:duration(zh(2014, 3, 29), zh(2014, 3, 31)) == 2 * 86400 - 3600)
+
+-- Overlap
+local NY = "America/New_York"
+local o = tz.overlap({ ZH, NY }, 8 * 3600, 18 * 3600, zh(2014, 3, 24), zh(2014, 4, 7))
+assert(#o == 14)
+assert(o[1][1] == tz.time({ year = 2014, month = 3, day = 24, hour = 8, min = 0 }, NY))
+assert(o[1][2] == zh(2014, 3, 24, 18))
+assert(o[7][2] - o[7][1] == 4 * 3600)  -- Zurich on DST, New York on DST
+assert(o[8][2] - o[8][1] == 4 * 3600)
+local o = tz.overlap({ ZH, "Asia/Kolkata" }, 22 * 3600, 6 * 3600, zh(2014, 2, 17), zh(2014, 2, 18))
+assert(#o == 2)
+assert(o[1][1] == zh(2014, 2, 17) and o[1][2] == zh(2014, 2, 17, 1, 30))
+assert(o[2][1] == zh(2014, 2, 17, 22) and o[2][2] == zh(2014, 2, 18))
+assert(#tz.overlap({ ZH, "Asia/Tokyo" }, 9 * 3600, 12 * 3600, zh(2014, 2, 17), zh(2014, 3, 17)) == 0)
+
+-- Delta
+local d = tz.delta(ZH, NY, zh(2014, 1, 1), zh(2015, 1, 1))
+assert(#d == 5)
+assert(d[1][1] == zh(2014, 1, 1) and d[1][2] == -6 * 3600)
+assert(d[2][1] == tz.time({ year = 2014, month = 3, day = 9, hour = 3 }, NY) and d[2][2] == -5 * 3600)
+assert(d[3][1] == 1396141200 and d[3][2] == -6 * 3600)
+assert(d[4][1] == 1414285200 and d[4][2] == -5 * 3600)
+assert(d[5][2] == -6 * 3600)
+local d = tz.delta(ZH, "Europe/Berlin", zh(2014, 1, 1), zh(2015, 1, 1))
+assert(#d == 1 and d[1][2] == 0)
+
+-- Diff
+assert(tz.diff(zh(2014, 3, 29, 12), zh(2014, 3, 30, 12), "day", ZH) == 1)
+assert(tz.diff(zh(2014, 3, 29, 12), zh(2014, 3, 30, 12), "hour", ZH) == 23)
+assert(tz.diff(zh(2014, 3, 29, 12), zh(2014, 3, 30, 11), "day", ZH) == 0)
+assert(tz.diff(zh(2014, 3, 30, 12), zh(2014, 3, 29, 12), "day", ZH) == -1)
+assert(tz.diff(zh(2014, 1, 31), zh(2014, 2, 28), "month", ZH) == 0)
+assert(tz.diff(zh(2014, 1, 31), zh(2014, 3, 31), "month", ZH) == 2)
+assert(tz.diff(zh(2014, 3, 31), zh(2014, 1, 31), "month", ZH) == -2)
+assert(tz.diff(zh(2012, 2, 29), zh(2014, 2, 28), "year", ZH) == 1)
+assert(tz.diff(zh(2014, 1, 1), zh(2014, 1, 15), "week", ZH) == 2)
+assert(tz.diff(0, 90, "min", ZH) == 1)
+local d = tz.diff(zh(2014, 1, 1), { zh(2014, 1, 2), zh(2014, 2, 1), zh(2013, 12, 1) }, "day", ZH)
+assert(#d == 3 and d[1] == 1 and d[2] == 31 and d[3] == -31)
+local d = tz.diff({ zh(2014, 1, 1), zh(2014, 1, 2) }, { zh(2014, 2, 1), zh(2014, 3, 1) }, "month", ZH)
+assert(#d == 2 and d[1] == 1 and d[2] == 1)
+
+-- Asynchronous loading
+local loader = tz.async("Asia/Manila")
+assert(tz.async("Asia/Manila") == loader)
+while not loader:ready() do end
+assert(loader:fd() == nil)
+assert(tz.info(1392456870, "Asia/Manila") == 28800)
+assert(tz.async(ZH):ready())
+local loader = tz.async("Unknown/Zone")
+local ok, err
+repeat
+	ok, err = pcall(loader.ready, loader)
+until not ok or err
+assert(not ok and err:find("unknown timezone"))
+local lua = arg and arg[-1]
+if lua then
+	-- states closing with loads pending, which unloads the module while the loads run
+	local chunk = string.format("package.cpath = %q; local tz = require('tz'); for _, zone in "
+			.. "ipairs({ 'Asia/Tokyo', 'Europe/Paris', 'Africa/Cairo' }) do tz.async(zone) end",
+			package.cpath)
+	for _ = 1, 10 do
+		local status = os.execute(string.format("%s -e %q", lua, chunk))
+		assert(status == true or status == 0)
+	end
+end
+if tz.await then
+	local co = coroutine.wrap(function ()
+		tz.await("Asia/Seoul")
+		return tz.info(1392456870, "Asia/Seoul")
+	end)
+	local result = co()
+	while type(result) == "userdata" do
+		assert(type(result:fd()) == "number")
+		result = co()
+	end
+	assert(result == 32400)
+	tz.await("Asia/Singapore")
+	assert(tz.info(1392456870, "Asia/Singapore") == 28800)
+end
+
+-- Trace
+local filename = os.tmpname()
+tz.trace(filename)
+tz.info(1392456870, ZH)
+tz.date("%Y", 1392456870, ZH)
+tz.time({ year = 2014, month = 2, day = 15 }, ZH)
+tz.time({ year = 2014, month = 2, day = 15, hour = 9, off = 3600 })
+tz.trace()
+local f = assert(io.open(filename, "rb"))
+local trace = f:read("*a")
+f:close()
+os.remove(filename)
+assert(trace:sub(1, 4) == "TZtr" and trace:find(ZH, 1, true) and trace:find("%Y", 1, true))
+if string.unpack then
+	local strings, records, pos = {}, {}, 10
+	while pos <= #trace do
+		local kind = trace:byte(pos)
+		if kind == 1 then
+			local id, s
+			id, s, pos = string.unpack("=I2s2", trace, pos + 1)
+			strings[id] = s
+		elseif kind == 2 then
+			local t, zone
+			t, zone, pos = string.unpack("=i8I2", trace, pos + 1)
+			records[#records + 1] = { kind = kind, t = t, zone = strings[zone] }
+		elseif kind == 3 then
+			local t, zone, format
+			t, zone, format, pos = string.unpack("=i8I2I2", trace, pos + 1)
+			records[#records + 1] = { kind = kind, t = t, zone = strings[zone],
+					format = strings[format] }
+		else
+			assert(kind == 4)
+			local record = { kind = kind }
+			record.zone, pos = string.unpack("=I2", trace, pos + 1)
+			record.zone = strings[record.zone]
+			record.fields = { string.unpack("=i4i4i4i4i4i4i4i4i4", trace, pos) }
+			pos = table.remove(record.fields)
+			records[#records + 1] = record
+		end
+	end
+	assert(#records == 4)
+	assert(records[1].kind == 2 and records[1].t == 1392456870 and records[1].zone == ZH)
+	assert(records[2].kind == 3 and records[2].t == 1392456870 and records[2].zone == ZH
+			and records[2].format == "%Y")
+	local fields = records[3].fields
+	assert(records[3].zone == ZH and fields[1] == 2014 and fields[2] == 2 and fields[3] == 15
+			and fields[4] == 12 and fields[7] == -1 and fields[8] == 1 and fields[9] == 0)
+	fields = records[4].fields
+	assert(records[4].zone == "localtime" and fields[4] == 9 and fields[8] == 2
+			and fields[9] == 3600)
+end
+
+-- Images
+local image = tz.dump(ZH)
+assert(tz.load_image(image, "Image/Zurich") == "Image/Zurich")
+assert(tz.date("%c %z", 1392456870, "Image/Zurich") == tz.date("%c %z", 1392456870, ZH))
+assert(tz.load_image(image) == ZH)
+assert(not pcall(tz.load_image, image:sub(1, -2)))
+assert(not pcall(tz.load_image, "TZif"))
+
+-- TZif data
+local f = assert(io.open("/usr/share/zoneinfo/" .. ZH, "rb"))
+local tzif = f:read("*a")
+f:close()
+tz.zone_from_tzif("Data/Zurich", tzif)
+assert(tz.date("%c %z", 1392456870, "Data/Zurich") == tz.date("%c %z", 1392456870, ZH))
+assert(not pcall(tz.zone_from_tzif, "Data/Broken", tzif:sub(1, 60)))
+assert(not pcall(tz.info, 0, "Data/Broken"))
+
+-- Cache bundle
+local dir = os.tmpname()
+os.remove(dir)
+assert(tz.cachedir(dir) == nil)
+debug.getregistry()["tz.cache"]["Europe/Oslo"] = nil
+debug.getregistry()["tz.cache"]["Europe/Vienna"] = nil
+assert(tz.info(1392456870, "Europe/Oslo") == 3600)
+assert(tz.info(1392456870, "Europe/Vienna") == 3600)
+assert(tz.cachewrite() == 2)
+assert(tz.cachewrite() == 0)
+local filename = dir .. "/tz.bundle"
+local function readbundle ()
+	local f = assert(io.open(filename, "rb"))
+	local bundle = f:read("*a")
+	f:close()
+	return bundle
+end
+local bundle = readbundle()
+if string.unpack then
+	-- patch entries in a copy of the bundle, which is then renamed into place
+	local function patch (zone, fn)
+		local count = string.unpack("=I4", bundle, 13)
+		local name = "/usr/share/zoneinfo/" .. zone
+		for i = 0, count - 1 do
+			local entry = 25 + i * 208
+			if string.unpack("z", bundle, entry) == name then
+				return fn(entry)
+			end
+		end
+		error("no bundle entry for " .. zone)
+	end
+	local function replace (pos, s)
+		bundle = bundle:sub(1, pos - 1) .. s .. bundle:sub(pos + #s)
+	end
+	local function reload (zone)
+		local f = assert(io.open(filename .. ".new", "wb"))
+		f:write(bundle)
+		f:close()
+		assert(os.rename(filename .. ".new", filename))
+		debug.getregistry()["tz.cache"][zone] = nil
+		assert(tz.cachedir(dir) == dir)
+	end
+	local function gmtoff (entry)
+		local offset = string.unpack("=I8", bundle, entry + 152)
+		local timecnt, typecnt = string.unpack("=i4i4", bundle, entry + 192)
+		for i = 0, typecnt - 1 do
+			replace(offset + timecnt * 8 + i * 8 + 1, string.pack("=i4", 12345))
+		end
+	end
+
+	-- loads from the bundle, synchronously and asynchronously
+	patch("Europe/Oslo", gmtoff)
+	patch("Europe/Vienna", gmtoff)
+	reload("Europe/Oslo")
+	assert(tz.info(1392456870, "Europe/Oslo") == 12345)
+	debug.getregistry()["tz.cache"]["Europe/Vienna"] = nil
+	local loader = tz.async("Europe/Vienna")
+	while not loader:ready() do end
+	assert(tz.info(1392456870, "Europe/Vienna") == 12345)
+
+	-- a stale entry falls back to the TZ file
+	patch("Europe/Oslo", function (entry)
+		replace(entry + 128, string.pack("=i8", 0))
+	end)
+	reload("Europe/Oslo")
+	assert(tz.info(1392456870, "Europe/Oslo") == 3600)
+	debug.getregistry()["tz.cache"]["Europe/Vienna"] = nil
+
+	-- the next write refreshes the stale entry
+	assert(tz.cachewrite() == 2)
+	bundle = readbundle()
+	patch("Europe/Oslo", function (entry)
+		assert(string.unpack("=i8", bundle, entry + 128) ~= 0)
+	end)
+end
+assert(tz.cachedir(false) == dir)
+assert(tz.cachewrite() == nil)
+assert(tz.cachedir() == nil)
+os.remove(filename)
+os.remove(dir)
+
+-- Lookup strategy
+assert(tz.strategy("UTC") == "const")
+local strategy, timecnt = tz.strategy(ZH)
+assert(strategy == "bucket" and timecnt > 2)
+for t = -2^31, 2^31, 86400 * 7 + 3599 do
+	assert(tz.date("%c", t, ZH) == os.date("%c", t))
+end
+
+-- Batch info
+local times = { 1392456870, 1402456870, -2^40, 2^40 }
+local offsets, dsts, abbrs = tz.info(times, ZH)
+for i, t in ipairs(times) do
+	local offset, dst, abbr = tz.info(t, ZH)
+	assert(offsets[i] == offset and dsts[i] == dst and abbrs[i] == abbr)
+end
+if string.pack then
+	local offsets = tz.info(string.pack("jj", 1392456870, 1402456870), ZH)
+	assert(select("#", string.unpack("i4i4", offsets)) == 3)
+	assert(string.unpack("i4", offsets) == 3600 and string.unpack("i4", offsets, 5) == 7200)
+end
+assert(tz.info(tostring(1392456870), ZH) == 3600)
+
+-- Batch breakdown
+assert(type(tz.simd) == "string")
+if string.unpack then
+	local times = { 1392456870, 1402456870, -2^31, 2^31, 2^40, -2^37, 0 }
+	local fields = tz.breakdown(times, ZH)
+	assert(#fields == #times * 32)
+	assert(tz.breakdown(string.pack("jjjjjjj", table.unpack(times)), ZH) == fields)
+	for i, t in ipairs(times) do
+		local d = tz.date("*t", t, ZH)
+		local sec, min, hour, day, month, year, wday, yday = string.unpack("i4i4i4i4i4i4i4i4",
+				fields, (i - 1) * 32 + 1)
+		assert(sec == d.sec and min == d.min and hour == d.hour and day == d.day
+				and month == d.month and year == d.year and wday == d.wday and yday == d.yday)
+	end
+	assert(tz.breakdown({ -2^50 }, "UTC") == string.rep("\0", 32))
+end
+
+-- Batch ISO format
+local iso = tz.isoformat({ 1392456870, 1402456870, -3000000000, 0 }, ZH)
+assert(iso == "2014-02-15T10:34:30+01:00" .. "2014-06-11T05:21:10+02:00"
+		.. "1874-12-07T19:09:46+00:29" .. "1970-01-01T01:00:00+01:00")
+assert(tz.isoformat({ 1392456870 }, "America/New_York") == "2014-02-15T04:34:30-05:00")
+assert(tz.isoformat("1392456870", "America/New_York") == "2014-02-15T04:34:30-05:00")
+assert(tz.isoformat(1392456870, "America/New_York") == "2014-02-15T04:34:30-05:00")
+assert(tz.breakdown("1392456870", ZH) == tz.breakdown({ 1392456870 }, ZH))
+assert(not pcall(tz.breakdown, true, ZH))
+assert(tz.isoformat({}, ZH) == "")
+assert(not pcall(tz.isoformat, { 2^40 }, ZH))
+if string.pack then
+	assert(tz.isoformat(string.pack("jj", 1392456870, 1402456870), ZH) == iso:sub(1, 50))
+end
+
+-- Batch ISO parse
+if string.unpack then
+	local times = string.pack("jjjj", 1392456870, 1402456870, -3000000000 + 46, 0)
+	assert(tz.isoparse(iso) == times)
+	assert(tz.isoparse(iso, nil, 25) == times)
+	assert(tz.isoparse({ "2014-02-15T10:34:30+01:00", "2014-06-11 03:21:10Z",
+			"2014-02-15T10:34:30" }, ZH) == string.pack("jjj", 1392456870, 1402456870,
+			1392456870))
+	assert(tz.isoparse("2014-02-15T10:34:302014-06-11T05:21:10", ZH)
+			== string.pack("jj", 1392456870, 1402456870))
+	assert(tz.isoparse("2014-02-15T10:34:30", 3600) == string.pack("j", 1392456870))
+	assert(tz.isoparse("2014-03-30T02:30:00", ZH) == tz.isoparse("2014-03-30T01:30:00Z"))
+end
+assert(tz.isoparse({}, ZH) == "")
+assert(not pcall(tz.isoparse, "2014-02-30T10:34:30", ZH))
+assert(not pcall(tz.isoparse, "2014-02-15T24:00:00", ZH))
+assert(not pcall(tz.isoparse, "2014-02-15X10:34:30", ZH))
+assert(not pcall(tz.isoparse, "2014-02-15T10:34:30+1:00", ZH))
+assert(not pcall(tz.isoparse, { "2014-02-15T10:34" }, ZH))
+assert(not pcall(tz.isoparse, "2014-02-15T10:34:30", ZH, 20))
+
+-- Date keys
+assert(tz.datekey(1392456870, ZH) == 20140215)
+assert(tz.datekey(1392456870, ZH, "year") == 2014)
+assert(tz.datekey(1392456870, ZH, "month") == 201402)
+assert(tz.datekey(1392456870, ZH, "hour") == 2014021510)
+assert(tz.datekey(1392456870, "America/New_York", "hour") == 2014021504)
+assert(tz.datepath(1392456870, ZH) == "year=2014/month=02/day=15")
+assert(tz.datepath(1392456870, ZH, "hour") == "year=2014/month=02/day=15/hour=10")
+assert(tz.datepath(1392456870, ZH, "year") == "year=2014")
+assert(not pcall(tz.datekey, 1392456870, ZH, "week"))
+for t = 1396141200 - 7200, 1396141200 + 7200, 600 do  -- DST change on 2014-03-30
+	assert(tz.datekey(t, ZH, "hour") == tonumber(tz.date("%Y%m%d%H", t, ZH)))
+	assert(tz.datepath(t, ZH, "hour") == tz.date("year=%Y/month=%m/day=%d/hour=%H", t, ZH))
+end
+local times = { 1392456870, 1392456871, 1402456870, 1392456870 }
+local keys, paths = tz.datekey(times, ZH), tz.datepath(times, ZH)
+for i, t in ipairs(times) do
+	assert(keys[i] == tz.datekey(t, ZH) and paths[i] == tz.datepath(t, ZH))
+end
+if string.pack then
+	assert(tz.datekey(string.pack("jj", 1392456870, 1402456870), ZH, "month")
+			== string.pack("jj", 201402, 201406))
+end
+
+-- Several formats
+local formats = { ISO, "!%a, %d %b %Y %H:%M:%S GMT", "*t", "!*t", "%Y%m%d" }
+local results = { tz.date(formats, 1392456870, ZH) }
+assert(#results == #formats)
+for i, format in ipairs(formats) do
+	local expected = tz.date(format, 1392456870, ZH)
+	if type(expected) == "table" then
+		for k, v in pairs(expected) do
+			assert(results[i][k] == v)
+		end
+	else
+		assert(results[i] == expected)
+	end
+end
+assert(results[2] == "Sat, 15 Feb 2014 09:34:30 GMT")
+assert(select("#", tz.date({}, 1392456870, ZH)) == 0)
+assert(not pcall(tz.date, { ISO, 1 }, 1392456870, ZH))
+
+-- Timers
+local timers = tz.timers()
+assert(tostring(timers):match("^tz.timers: "))
+local once = timers:add({ year = 2014, month = 2, day = 15, hour = 10, min = 34, sec = 30 }, ZH)
+local daily = timers:add({ year = 2014, month = 3, day = 29, hour = 9 }, ZH, "day")
+local monthly = timers:add({ year = 2014, month = 1, day = 31, hour = 9 }, "UTC", "month")
+local removed = timers:add({ year = 2014, month = 1, day = 1 }, ZH)
+assert(#timers == 4)
+assert(timers:remove(removed) and not timers:remove(removed))
+assert(timers:next() == tz.time({ year = 2014, month = 1, day = 31, hour = 9 }, "UTC"))
+local ids = timers:pop_due(1392456870)
+assert(#ids == 2 and ids[1] == monthly and ids[2] == once and #timers == 2)
+assert(timers:next() == tz.time({ year = 2014, month = 2, day = 28, hour = 9 }, "UTC"))
+ids = timers:pop_due(tz.time({ year = 2014, month = 3, day = 29, hour = 10 }, ZH))
+assert(#ids == 2 and ids[1] == monthly and ids[2] == daily)
+assert(timers:next() == tz.time({ year = 2014, month = 3, day = 30, hour = 9 }, ZH))
+assert(timers:next() == 1396162800)  -- 07:00 UTC after the change to CEST
+assert(#timers:pop_due(0) == 0)
+ids = timers:pop_due(2^40)
+assert(#ids == 2 and #timers == 2)
+local next = tz.date("*t", timers:next(), ZH)
+assert(timers:next() > 2^40 and timers:next() <= 2^40 + 86400 and next.hour == 9)
+assert(tz.date("*t", timers:pop_due(timers:next()) and timers:next(), ZH).hour == 9)
+if math.maxinteger then
+	ids = timers:pop_due(math.maxinteger)
+	assert(#ids == 2 and #timers == 0 and timers:next() == nil)
+end
+assert(not pcall(timers.add, timers, {}, ZH))
+
+-- Durations and intervals
+local jan31 = tz.time({ year = 2023, month = 1, day = 31, hour = 12 }, ZH)
+assert(tz.date(ISO, tz.add(jan31, "P1M", ZH), ZH) == "2023-02-28T12:00:00")
+assert(tz.date(ISO, tz.add(jan31, "-P1M", ZH), ZH) == "2022-12-31T12:00:00")
+assert(tz.date(ISO, tz.add(jan31, "P1Y2M3W4DT5H6M7S", ZH), ZH) == "2024-04-25T17:06:07")
+local mar25 = tz.time({ year = 2023, month = 3, day = 25, hour = 12 }, ZH)
+assert(tz.add(mar25, "P1D", ZH) == mar25 + 82800)  -- across the change to CEST
+assert(tz.add(mar25, "PT24H", ZH) == mar25 + 86400)
+for _, duration in ipairs({ "P", "PT", "P1", "P1H", "PT1D", "P1M1Y", "P1.5D", "P1DT" }) do
+	assert(not pcall(tz.add, jan31, duration, ZH))
+end
+local fold = 1698539400  -- 2023-10-29T02:30:00+02:00, first of two 02:30 in ZH
+assert(tz.add(tz.add(fold, "P1D", ZH), "-P1D", ZH) == fold)
+assert(tz.add(fold - 86400, "P1D", ZH) == fold and tz.add(fold, "P0D", ZH) == fold)
+assert(tz.interval("2023-10-29T02:30:00+02:00/P1D", ZH) == fold)
+assert(tz.interval("2023-10-29T02:30:00+01:00/P1D", ZH) == fold + 3600)
+assert(tz.add(-210866803200 + 10, "-PT1H", ZH) == nil)
+if math.maxinteger then
+	assert(tz.add(math.maxinteger - 10, "PT1H", ZH) == nil)
+end
+local start, finish, count = tz.interval("R5/2023-01-31T12:00/P1M", ZH)
+assert(start == jan31 and finish == tz.add(jan31, "P1M", ZH) and count == 5)
+assert(select(3, tz.interval("R/2023-01-31T12:00/P1M", ZH)) == nil)
+assert(select(3, tz.interval("2023-01-01T00:00Z/2023-01-02T00:00+01:00", ZH)) == 1)
+local ends = {}
+for _, finish in tz.occurrences("R3/2023-01-31T12:00/P1M", ZH) do
+	ends[#ends + 1] = tz.date(ISO, finish, ZH)
+end
+assert(#ends == 3 and ends[1] == "2023-02-28T12:00:00" and ends[3] == "2023-04-30T12:00:00")
+local starts = {}
+for start in tz.occurrences("R2/P1D/2023-03-27T00:00:00Z", ZH) do
+	starts[#starts + 1] = start
+end
+assert(#starts == 2 and starts[2] == tz.time({ year = 2023, month = 3, day = 26, hour = 3 }, ZH))
+assert(not pcall(tz.interval, "R/P1D/2023-01-01", ZH))
+assert(not pcall(tz.interval, "2023-01-01/2023-02-01/2023-03-01", ZH))
+
+-- Relative dates
+local friday = tz.time({ year = 2023, month = 3, day = 24, hour = 15, min = 20 }, ZH)
+local resolved = {
+	["now"] = "2023-03-24T15:20:00",
+	["tomorrow 17:30"] = "2023-03-25T17:30:00",
+	["Yesterday"] = "2023-03-23T00:00:00",
+	["next monday 9am"] = "2023-03-27T09:00:00",
+	["at 9am next tue"] = "2023-03-28T09:00:00",
+	["friday"] = "2023-03-24T00:00:00",
+	["next friday"] = "2023-03-31T00:00:00",
+	["last friday at noon"] = "2023-03-17T12:00:00",
+	["in 3 days"] = "2023-03-27T15:20:00",
+	["in an hour"] = "2023-03-24T16:20:00",
+	["2 weeks ago"] = "2023-03-10T15:20:00",
+	["next month"] = "2023-04-24T15:20:00",
+	["9:30 pm, tomorrow"] = "2023-03-25T21:30:00",
+	["sunday 2:30am"] = "2023-03-26T03:30:00",  -- nonexistent local time
+}
+for phrase, expected in pairs(resolved) do
+	assert(tz.date(ISO, tz.resolve(phrase, friday, ZH), ZH) == expected)
+end
+for _, phrase in ipairs({ "", "9", "next", "in 3", "3 days", "now 9am", "in 2 hours at 5pm",
+		"next hour", "13pm", "tomorrow 25:00", "tomorrow tomorrow" }) do
+	assert(tz.resolve(phrase, friday, ZH) == nil)
+end
+
+-- Scales
+assert(tz.convert(946728000, "unix", "jd") == 2451545)
+assert(tz.convert(51544, "mjd", "unix") == 946684800)
+assert(tz.convert(0, "unix", "excel") == 25569)
+assert(tz.convert(0, "unix", "ntp") == 2208988800)
+assert(tz.convert(0, "gps", "unix") == 315964800)
+assert(tz.convert(1700000000, "unix", "gps") == 1384035218)
+assert(tz.convert(1483228800, "unix", "gps") - tz.convert(1483228799, "unix", "gps") == 2)
+assert(tz.convert(1384035218, "gps", "unix") == 1700000000)
+local noon = tz.time({ year = 2023, month = 3, day = 15, hour = 12 }, ZH)
+assert(tz.convert(45000.5, "excel", "unix", ZH) == noon)
+assert(tz.convert(noon, "unix", "excel", ZH) == 45000.5)
+assert(math.abs(tz.convert(noon, "unix", "excel") - (45000.5 - 1 / 24)) < 1e-9)
+local values = tz.convert({ 0, 1000000000 }, "unix", "ntp")
+assert(#values == 2 and values[1] == 2208988800 and values[2] == 3208988800)
+assert(tz.convert(0 / 0, "unix", "jd") == nil)
+assert(not pcall(tz.convert, { 1, "x" }, "unix", "jd"))
+assert(not pcall(tz.convert, 1, "unix", "tai"))
+
+-- Export
+tz.zone_from_tzif("Export/Zurich", tz.export(ZH))
+tz.load_image(tz.export(ZH, "image"), "Export/Image")
+local from, to = 946684800, 1893456000  -- 2000 to 2030
+tz.zone_from_tzif("Export/Window", tz.export(ZH, "tzif", from, to))
+assert(#tz.export(ZH, "tzif", from, to) < #tz.export(ZH))
+for _, t in ipairs({ -3000000000, 0, 1392456870, 1404000000, 1900000000, 4000000000 }) do
+	assert(tz.info(t, "Export/Zurich") == tz.info(t, ZH))
+	assert(tz.info(t, "Export/Image") == tz.info(t, ZH))
+	assert(select(2, tz.info(t, "Export/Zurich")) == select(2, tz.info(t, ZH)))
+end
+for _, t in ipairs({ from, 1392456870, 1404000000, to }) do
+	assert(tz.date("%c %z %Z", t, "Export/Window") == tz.date("%c %z %Z", t, ZH))
+end
+assert(tz.info(0, "Export/Window") == tz.info(from, ZH))
+local f = assert(io.open("/usr/share/zoneinfo/" .. ZH, "rb"))
+local footer = f:read("*a"):match("\n([^\n]*)\n$")
+f:close()
+assert(footer ~= "" and tz.export(ZH):match("\n([^\n]*)\n$") == footer)
+assert(tz.export("Export/Zurich"):match("\n([^\n]*)\n$") == footer)
+assert(tz.export(ZH, "tzif", from):match("\n([^\n]*)\n$") == footer)
+assert(tz.export(ZH, "tzif", from, to):match("\n([^\n]*)\n$") == "CET-1")
+assert(tz.export(ZH, "tzif", from, 1404000000):match("\n([^\n]*)\n$") == "CEST-2")
+assert(tz.export("Asia/Kathmandu", "tzif", 0, 0):match("\n([^\n]*)\n$") == "<+0530>-5:30")
+local early = tz.export("America/New_York", "tzif", nil, -3000000000)
+assert(early:match("\n([^\n]*)\n$") == "LMT4:56:02")
+tz.zone_from_tzif("Export/Early", early)
+assert(tz.info(0, "Export/Early") == -17762)
+assert(not pcall(tz.export, ZH, "tzif", to, from))
+local dir = os.tmpname()
+os.remove(dir)
+assert(tz.exportdir(dir, { ZH, ["Europe/Busingen"] = ZH }, "tzif", from, to) == 2)
+local f = assert(io.open(dir .. "/Europe/Busingen", "rb"))
+assert(f:read("*a") == tz.export(ZH, "tzif", from, to))
+f:close()
+assert(not pcall(tz.exportdir, dir, { ZH, Link = "Asia/Tokyo" }))
+assert(not pcall(tz.exportdir, dir, { "../Zurich" }))
+os.remove(dir .. "/Europe/Busingen")
+os.remove(dir .. "/Europe/Zurich")
+os.remove(dir .. "/Europe")
+os.remove(dir)